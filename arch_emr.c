@@ -1,10 +1,14 @@
 #include "common.h"
 #include "arch_emr.h"
 
+#include "arch_emr_isa.h"
+#include "arch_emr_phash.h"
+#include "arena.h"
 #include "bufman.h"
-#include "cpic.h"
 #include "dict.h"
 #include "fail.h"
+#include "scan.h"
+#include "symtab.h"
 #include "utils.h"
 
 #include <inttypes.h>
@@ -15,15 +19,37 @@
 #include <sys/types.h>
 
 
-#define CHUNK_LEN 128
-#define BUFCAP (CHUNK_LEN * 2)
-#define CFG_MEM_SIZE 0x10
-
 #define min(x, y) ((x) < (y) ? (x) : (y))
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
 
-char buf[CHUNK_LEN * 2 + 1];
+// The mnemonic and core register tables are fixed, so they're looked up
+// through perfect hashes generated at build time by gen_phash.
+
+static inline
+const struct insn* insn_lookup(const char* str, size_t len)
+{
+    uint32_t h = isa_hash(str, len, INSN_PHASH_SEED);
+    uint32_t slot = isa_slot(h, insn_phash_disp[h % INSN_PHASH_BUCKETS],
+        INSN_PHASH_LEN);
+    const struct insn* oi = &insns_ref[insn_phash_index[slot]];
+    if (strncmp(oi->str, str, len) != 0 || oi->str[len] != '\0')
+        return NULL;
+    return oi;
+}
+
+
+static inline
+const struct creg* creg_lookup(const char* str, size_t len)
+{
+    uint32_t h = isa_hash(str, len, CREG_PHASH_SEED);
+    uint32_t slot = isa_slot(h, creg_phash_disp[h % CREG_PHASH_BUCKETS],
+        CREG_PHASH_LEN);
+    const struct creg* creg = &cregs_ref[creg_phash_index[slot]];
+    if (strncmp(creg->name, str, len) != 0 || creg->name[len] != '\0')
+        return NULL;
+    return creg;
+}
 
 
 enum token_type {
@@ -37,348 +63,166 @@ enum token_type {
 
 struct token {
     enum token_type type;
-    char* text;
+    const char* text; // (not NUL-terminated)
+    size_t len;
+    int sym;
     uint16_t num;
 };
 
 
-static inline
-void print_token(struct token* token)
-{
-    if (token->type == T_TEXT)
-        printf("  text: \"%s\"\n", token->text);
-    else if (token->type == T_NUMBER)
-        printf("  number: 0x%04"PRIX16"\n", token->num);
-    else if (token->type == T_COLON)
-        print("  colon\n");
-    else if (token->type == T_COMMA)
-        print("  comma\n");
-    else
-        fatal(1, "Invalid token");
-}
-
-
-enum opcode {
-    C_NONE,
-
-    C_ADDWF,
-    C_ADDWFC,
-    C_ANDWF,
-    C_ASRF,
-    C_LSLF,
-    C_LSRF,
-    C_CLRF,
-    C_CLRW,
-    C_COMF,
-    C_DECF,
-    C_INCF,
-    C_IORWF,
-    C_MOVF,
-    C_MOVWF,
-    C_RLF,
-    C_RRF,
-    C_SUBWF,
-    C_SUBWFB,
-    C_SWAPF,
-    C_XORWF,
-
-    C_DECFSZ,
-    C_INCFSZ,
-
-    C_BCF,
-    C_BSF,
-
-    C_BTFSC,
-    C_BTFSS,
-
-    C_ADDLW,
-    C_ANDLW,
-    C_IORLW,
-    C_MOVLB,
-    C_MOVLP,
-    C_MOVLW,
-    C_SUBLW,
-    C_XORLW,
-
-    C_BRA,
-    C_BRW,
-    C_CALL,
-    C_CALLW,
-    C_GOTO,
-    C_RETFIE,
-    C_RETLW,
-    C_RETURN,
-
-    C_CLRWDT,
-    C_NOP,
-    C_OPTION,
-    C_RESET,
-    C_SLEEP,
-    C_TRIS,
-
-    C_ADDFSR,
-    C_MOVIW,
-    C_MOVWI,
-
-    C_MOVPLW,
-    C_MOVPHW,
-
-    C__LAST__,
-
-    CD_SFR,
-    CD_GPR,
-    CD_REG,
-    CD_CREG,
-    CD_CFG,
-
-    CD__LAST__,
-
-    // TODO: Implement more.
-};
-
-
-enum operand_type {
-    NONE__ = 0, // none
-    F, // register
-    B, // bit number (0 - 7)
-    K, // miscellaneous number
-    L, // program address or label
-    D, // destination select (0 = W, 1 = f)
-    T, // TRIS operand (5 - 7)
-    N, // FSR number
-    M, // FSR number with pre-/post-decrement/-increment
-    A, // bank number
-    I, // new identifier
-};
-
-
-struct insn {
-    const char* str;
-    enum opcode opc;
-    uint16_t word;
-    enum operand_type opds[2];
-    int kwid;
-} insn_array[512];
-
-
-struct dict insns = {
-    .array = insn_array,
-    .capacity = lengthof(insn_array),
-    .value_len = sizeof(struct insn),
-};
+// (For .reg without a bank, until it's placed.)
+#define REG_AUTO -2
+// (For .local, until its subroutine's frame is placed.)
+#define REG_LOCAL -3
 
 
 struct reg {
-    const char* name;
-    int bank;
+    int bank; // (negative if undefined)
     int addr;
-} reg_array[2048];
-
-
-struct dict regs = {
-    .array = reg_array,
-    .capacity = lengthof(reg_array),
-    .value_len = sizeof(struct reg),
 };
 
 
-struct creg {
-    const char* name;
-    int addr;
-} creg_array[128];
+// GPR that .reg hands out, as given by .gpr.
+struct gpr_space {
+    int* next; // (next free address in each bank, NULL before .gpr)
+    int bankmin;
+    int bankmax;
+    int addrmax; // (last address in the last bank)
+    unsigned int common; // (common RAM it takes in, bit k for 0x70 + k)
+};
 
 
-struct dict cregs = {
-    .array = creg_array,
-    .capacity = lengthof(creg_array),
-    .value_len = sizeof(struct creg),
-};
+// All the state of one assembly. Only the instruction and core register
+// tables are shared, so separate contexts can be used from separate threads.
+struct emr {
+    // Everything allocated for one assembly lives here and is dropped at
+    // once when it's done.
+    struct arena arena;
+    struct symtab syms;
 
+    // These are indexed by symbol ID and sized once lexing is done, since
+    // every name in the source has been interned by then.
+    struct reg* reg_array;
+    struct creg* creg_array; // (only those defined with .creg)
+    int* label_array; // (negative if undefined)
+    unsigned int* inline_array; // (line of its .inline, or 0)
 
-struct label {
-    const char* name;
-    int addr;
-} label_array[2048];
+    struct gpr_space gpr; // (as pass 1 leaves it)
 
+    struct line_cache* cache; // (NULL unless enabled)
 
-struct dict labels = {
-    .array = label_array,
-    .capacity = lengthof(label_array),
-    .value_len = sizeof(struct label),
+    FILE* list;
+    int verbosity;
+    unsigned int opt; // (CPIC_OPT_* passes to run)
+    const char* profile; // (label counts for opt_place(), or NULL)
+    size_t profile_len;
 };
 
 
-struct insn insns_ref[] = {
-    { .opc = C_ADDWF, .str = "addwf", .word = 0x0700, .opds = {F, D} },
-    { .opc = C_ADDWFC, .str = "addwfc", .word = 0x3D00, .opds = {F, D} },
-    { .opc = C_ANDWF, .str = "andwf", .word = 0x0500, .opds = {F, D} },
-    { .opc = C_ASRF, .str = "asrf", .word = 0x3700, .opds = {F, D} },
-    { .opc = C_LSLF, .str = "lslf", .word = 0x3500, .opds = {F, D} },
-    { .opc = C_LSRF, .str = "lsrf", .word = 0x3600, .opds = {F, D} },
-    { .opc = C_CLRF, .str = "clrf", .word = 0x0180, .opds = {F, 0} },
-    { .opc = C_CLRW, .str = "clrw", .word = 0x0100, .opds = {0, 0} },
-    { .opc = C_COMF, .str = "comf", .word = 0x0900, .opds = {F, D} },
-    { .opc = C_DECF, .str = "decf", .word = 0x300, .opds = {F, D} },
-    { .opc = C_INCF, .str = "incf", .word = 0x0A00, .opds = {F, D} },
-    { .opc = C_IORWF, .str = "iorwf", .word = 0x0400, .opds = {F, D} },
-    { .opc = C_MOVF, .str = "movf", .word = 0x0800, .opds = {F, D} },
-    { .opc = C_MOVWF, .str = "movwf", .word = 0x0080, .opds = {F, 0} },
-    { .opc = C_RLF, .str = "rlf", .word = 0x0D00, .opds = {F, D} },
-    { .opc = C_RRF, .str = "rrf", .word = 0x0C00, .opds = {F, D} },
-    { .opc = C_SUBWF, .str = "subwf", .word = 0x0200, .opds = {F, D} },
-    { .opc = C_SUBWFB, .str = "subwfb", .word = 0x3B00, .opds = {F, D} },
-    { .opc = C_SWAPF, .str = "swapf", .word = 0x0E00, .opds = {F, D} },
-    { .opc = C_XORWF, .str = "xorwf", .word = 0x0600, .opds = {F, D} },
-
-    { .opc = C_DECFSZ, .str = "decfsz", .word = 0x0B00, .opds = {F, D} },
-    { .opc = C_INCFSZ, .str = "incfsz", .word = 0x0F00, .opds = {F, D} },
-
-    { .opc = C_BCF, .str = "bcf", .word = 0x1000, .opds = {F, B} },
-    { .opc = C_BSF, .str = "bsf", .word = 0x1400, .opds = {F, B} },
-
-    { .opc = C_BTFSC, .str = "btfsc", .word = 0x1800, .opds = {F, B} },
-    { .opc = C_BTFSS, .str = "btfss", .word = 0x1C00, .opds = {F, B} },
-
-    { .opc = C_ADDLW, .str = "addlw", .word = 0x3E00, .opds = {K, 0},
-        .kwid = 8 },
-    { .opc = C_ANDLW, .str = "andlw", .word = 0x3900, .opds = {K, 0},
-        .kwid = 8 },
-    { .opc = C_IORLW, .str = "iorlw", .word = 0x3800, .opds = {K, 0},
-        .kwid = 8 },
-    { .opc = C_MOVLB, .str = "movlb", .word = 0x0020, .opds = {F, 0},
-        .kwid = 5 },
-    { .opc = C_MOVLP, .str = "movlp", .word = 0x3180, .opds = {L, 0},
-        .kwid = 7 },
-    { .opc = C_MOVLW, .str = "movlw", .word = 0x3000, .opds = {K, 0},
-        .kwid = 8 },
-    { .opc = C_SUBLW, .str = "sublw", .word = 0x3C00, .opds = {K, 0},
-        .kwid = 8 },
-    { .opc = C_XORLW, .str = "xorlw", .word = 0x3A00, .opds = {K, 0},
-        .kwid = 8 },
-
-    { .opc = C_BRA, .str = "bra", .word = 0x3200, .opds = {L, 0}, .kwid = 9 },
-    { .opc = C_BRW, .str = "brw", .word = 0x000B, .opds = {0, 0} },
-    { .opc = C_CALL, .str = "call", .word = 0x2000, .opds = {L, 0},
-        .kwid = 11 },
-    { .opc = C_CALLW, .str = "callw", .word = 0x000A, .opds = {0, 0} },
-    { .opc = C_GOTO, .str = "goto", .word = 0x2800, .opds = {L, 0},
-        .kwid = 11 },
-    { .opc = C_RETFIE, .str = "retfie", .word = 0x0009, .opds = {0, 0} },
-    { .opc = C_RETLW, .str = "retlw", .word = 0x3400, .opds = {K, 0},
-        .kwid = 8 },
-    { .opc = C_RETURN, .str = "return", .word = 0x0008, .opds = {0, 0} },
-
-    { .opc = C_CLRWDT, .str = "clrwdt", .word = 0x0064, .opds = {0, 0} },
-    { .opc = C_NOP, .str = "nop", .word = 0x0000, .opds = {0, 0} },
-    { .opc = C_OPTION, .str = "option", .word = 0x0062, .opds = {0, 0} },
-    { .opc = C_RESET, .str = "reset", .word = 0x0001, .opds = {0, 0} },
-    { .opc = C_SLEEP, .str = "sleep", .word = 0x0063, .opds = {0, 0} },
-    { .opc = C_TRIS, .str = "tris", .word = 0x0060, .opds = {T, 0} },
-
-    { .opc = C_ADDFSR, .str = "addfsr", .word = 0x3100, .opds = {N, K},
-        .kwid=6 },
-    { .opc = C_MOVIW, .str = "moviw", .word = 0x0010, .opds = {M, 0} },
-    { .opc = C_MOVWI, .str = "movwi", .word = 0x0018, .opds = {M, 0} },
-
-    { .opc = C_MOVPLW, .str = "movplw", .opds = {L, 0} },
-    { .opc = C_MOVPHW, .str = "movphw", .opds = {L, 0} },
-
-    { .opc = CD_SFR, .str = ".sfr", .opds = {F, I} },
-    { .opc = CD_GPR, .str = ".gpr", .opds = {F, F} },
-    { .opc = CD_REG, .str = ".reg", .opds = {A, I} },
-    { .opc = CD_CREG, .str = ".creg", .opds = {I, 0} },
-    { .opc = CD_CFG, .str = ".cfg", .opds = {K, K}, .kwid = 16 },
-};
+static
+const struct creg* find_creg(struct emr* const ctx, int sym)
+{
+    if (ctx->creg_array[sym].addr >= 0)
+        return &ctx->creg_array[sym];
+    return creg_lookup(sym_name(&ctx->syms, sym), sym_len(&ctx->syms, sym));
+}
 
 
-struct creg cregs_ref[] = {
-    { .name = "INDF0", .addr = 0x00 },
-    { .name = "INDF1", .addr = 0x01 },
-    { .name = "PCL", .addr = 0x02 },
-    { .name = "STATUS", .addr = 0x03 },
-    { .name = "FSR0L", .addr = 0x04 },
-    { .name = "FSR0H", .addr = 0x05 },
-    { .name = "FSR1L", .addr = 0x06 },
-    { .name = "FSR1H", .addr = 0x07 },
-    { .name = "BSR", .addr = 0x08 },
-    { .name = "WREG", .addr = 0x09 },
-    { .name = "PCLATH", .addr = 0x0A },
-    { .name = "INTCON", .addr = 0x0B },
-};
+static inline
+void print_token(struct emr* const ctx, struct token* token)
+{
+    if (token->type == T_TEXT)
+        fprintf(ctx->list, "  text: \"%.*s\"\n", (int)token->len,
+            token->text);
+    else if (token->type == T_NUMBER)
+        fprintf(ctx->list, "  number: 0x%04"PRIX16"\n", token->num);
+    else if (token->type == T_COLON)
+        fputs("  colon\n", ctx->list);
+    else if (token->type == T_COMMA)
+        fputs("  comma\n", ctx->list);
+    else
+        fatal(1, "Invalid token");
+}
 
 
 struct line {
     struct line* next;
 
-    struct insn* oi;
+    const struct insn* oi;
     bool star;
 
-    const char* label;
+    int label;
+    int bank; // (negative if no banked register)
 
     struct operand {
         int i;
-        const char* s;
+        int sym;
     } opds[2];
 
     unsigned int num;
 };
 
 
-void print_line(struct line* line)
+void print_line(struct emr* const ctx, struct line* line)
 {
     if (line->oi->opc == C_NONE)
         return;
 
-    struct insn* oi = line->oi;
+    const struct insn* oi = line->oi;
 
     if ( !(C_NONE < oi->opc && oi->opc < CD__LAST__) )
         fatal(2, "Not implemented");
 
-    printf("% 3d:  ", line->num);
+    fprintf(ctx->list, "% 3d:  ", line->num);
 
-    if (line->label != NULL)
-        printf("%s: ", line->label);
+    if (line->label != SYM_NONE)
+        fprintf(ctx->list, "%s: ", sym_name(&ctx->syms, line->label));
     if (line->star)
-        putchar('*');
-    print(oi->str);
+        fputc('*', ctx->list);
+    fputs(oi->str, ctx->list);
 
     for (unsigned int i = 0; i < 2 && oi->opds[i] != 0; ++i) {
         struct operand* opd = &line->opds[i];
 
         if (i == 1 && oi->opds[1] == D && opd->i == 1)
             break;
+        bool no_bank = (oi->opc == CD_REG && line->opds[0].i < 0);
+        if (i == 0 && no_bank)
+            continue;
 
-        if (i == 0)
-            putchar(' ');
+        if (i == 0 || no_bank)
+            fputc(' ', ctx->list);
         else
-            print(", ");
+            fputs(", ", ctx->list);
 
-        if (opd->s != NULL) {
-            print(opd->s);
+        if (opd->sym != SYM_NONE) {
+            fputs(sym_name(&ctx->syms, opd->sym), ctx->list);
         } else {
             switch (oi->opds[i]) {
                 case F:
                 case K:
-                    printf("0x%02X", opd->i);
+                    fprintf(ctx->list, "0x%02X", opd->i);
                     break;
                 case L:
                     if (opd->i < 0)
-                        printf("-0x%02"PRIX8, -(int16_t)opd->i);
+                        fprintf(ctx->list, "-0x%02"PRIX8,
+                            -(int16_t)opd->i);
                     else
-                        printf("0x%02"PRIX8, (int16_t)opd->i);
+                        fprintf(ctx->list, "0x%02"PRIX8, (int16_t)opd->i);
                     break;
                 case B:
                 case A:
-                    printf("%d", opd->i);
+                    fprintf(ctx->list, "%d", opd->i);
                     break;
                 case D:
-                    putchar('0'); // (Already handled 1.)
+                    fputc('0', ctx->list); // (Already handled 1.)
                     break;
                 case N:
-                    printf("FSR%d", line->opds[0].i);
+                    fprintf(ctx->list, "FSR%d", line->opds[0].i);
                     break;
                 case M:
-                    printf("FSR%d, %d", line->opds[0].i, line->opds[1].i);
+                    fprintf(ctx->list, "FSR%d, %d", line->opds[0].i,
+                        line->opds[1].i);
                     break;
                 default:
                     fatal(E_RARE, "Impossible situation");
@@ -388,60 +232,166 @@ void print_line(struct line* line)
 }
 
 
-struct line* insert_line(struct line* next)
+struct line* insert_line(struct emr* const ctx, struct line* next)
 {
-    struct line* new = malloc(sizeof(struct line));
+    struct line* new = arena_alloc(&ctx->arena, sizeof(struct line));
     new->next = next;
     new->label = next->label;
-    next->label = NULL;
+    next->label = SYM_NONE;
+    new->bank = -1;
     new->num = next->num;
 
     return new;
 }
 
 
-struct line* append_line(struct line* prev)
+struct line* append_line(struct emr* const ctx, struct line* prev)
 {
-    struct line* new = malloc(sizeof(struct line));
+    struct line* new = arena_alloc(&ctx->arena, sizeof(struct line));
     new->next = prev->next;
     prev->next = new;
     new->label = prev->label;
-    prev->label = NULL;
+    prev->label = SYM_NONE;
+    new->bank = -1;
     new->num = prev->num;
 
     return new;
 }
 
 
+// Class of each byte in a number: a digit's value with DC_DIGIT set, DC_SEP
+// for the '_' separator, or 0 for anything else.
+
+#define DC_DIGIT 0x10
+#define DC_SEP 0x20
+
+#define DIGIT(c, v) [c] = DC_DIGIT | (v)
+
+static const uint8_t digit_class[256] = {
+    DIGIT('0', 0), DIGIT('1', 1), DIGIT('2', 2), DIGIT('3', 3),
+    DIGIT('4', 4), DIGIT('5', 5), DIGIT('6', 6), DIGIT('7', 7),
+    DIGIT('8', 8), DIGIT('9', 9),
+    DIGIT('A', 10), DIGIT('B', 11), DIGIT('C', 12), DIGIT('D', 13),
+    DIGIT('E', 14), DIGIT('F', 15),
+    DIGIT('a', 10), DIGIT('b', 11), DIGIT('c', 12), DIGIT('d', 13),
+    DIGIT('e', 14), DIGIT('f', 15),
+    ['_'] = DC_SEP,
+};
+
+#undef DIGIT
+
+
+#define SWAR_ONES 0x0101010101010101u
+#define SWAR_HIGHS 0x8080808080808080u
+
+// High bit of each byte set if that byte is >= n or <= n. Only valid when
+// every byte is below 0x80.
+#define swar_ge(x, n) (((x) + (0x80 - (n)) * SWAR_ONES) & SWAR_HIGHS)
+#define swar_le(x, n) (~((x) + (0x7F - (n)) * SWAR_ONES) & SWAR_HIGHS)
+
+
+// Convert 8 hex digits at once. Returns false if any of them isn't a hex
+// digit (including '_'), in which case the caller goes byte by byte.
+static inline
+bool swar_hex8(const char* t, uint32_t* const v)
+{
+    uint64_t x;
+    memcpy(&x, t, sizeof(x));
+    if (x & SWAR_HIGHS)
+        return false;
+
+    uint64_t lower = x | 0x20 * SWAR_ONES;
+    uint64_t digit = swar_ge(x, '0') & swar_le(x, '9');
+    uint64_t alpha = swar_ge(lower, 'a') & swar_le(lower, 'f');
+    if ((digit | alpha) != SWAR_HIGHS)
+        return false;
+
+    // Nibble values, first digit in the lowest byte.
+    x = (x & 0x0F * SWAR_ONES) + (alpha >> 7) * 9;
+
+    // Pack them, most significant digit first.
+    x = ((x & 0x000F000F000F000Fu) << 4) | ((x >> 8) & 0x000F000F000F000Fu);
+    x = ((x & 0x000000FF000000FFu) << 8) | ((x >> 16) & 0x000000FF000000FFu);
+    x = ((x & 0xFFFFu) << 16) | ((x >> 32) & 0xFFFFu);
+    *v = x;
+    return true;
+}
+
+
+// Convert 8 binary digits at once, like swar_hex8.
 static inline
-ssize_t fill_buffer(const int src, size_t* const bufpos, size_t* const buflen,
-        size_t* const keep)
+bool swar_bin8(const char* t, uint32_t* const v)
+{
+    uint64_t x;
+    memcpy(&x, t, sizeof(x));
+    x ^= '0' * SWAR_ONES;
+    if (x & ~SWAR_ONES)
+        return false;
+    *v = (x * 0x8040201008040201u) >> 56;
+    return true;
+}
+
+
+// Accumulate the digits of t in the given radix, skipping separators.
+// Returns false on an invalid character and sets *overflow if the result
+// doesn't fit in 16 bits.
+static
+bool parse_digits(const char* t, size_t len, unsigned int radix,
+        uint16_t* const num, bool* const overflow)
 {
-    if (*buflen - *keep > CHUNK_LEN)
-        fatal(1, "Buffer is already full");
-    ssize_t count = bufgrab(src, buf, buflen, CHUNK_LEN, *keep);
-    if (count < 0)
-        fatal_e(1, "Can't read from source file");
-    *bufpos = *bufpos - *keep;
-    buf[*buflen] = '\0';
-    *keep = 0;
-    return count;
+    uint32_t acc = 0;
+    size_t i = 0;
+
+    uint32_t v;
+    if (radix == 16) {
+        for (/* */; i + 8 <= len && swar_hex8(&t[i], &v); i += 8) {
+            if (acc != 0 || v > 0xFFFF)
+                *overflow = true;
+            acc = v & 0xFFFF;
+        }
+    } else if (radix == 2) {
+        for (/* */; i + 8 <= len && swar_bin8(&t[i], &v); i += 8) {
+            acc = (acc << 8) | v;
+            if (acc > 0xFFFF) {
+                *overflow = true;
+                acc &= 0xFFFF;
+            }
+        }
+    }
+
+    for (/* */; i < len; ++i) {
+        uint8_t c = digit_class[(unsigned char)t[i]];
+        if (c == DC_SEP)
+            continue;
+        if (!(c & DC_DIGIT) || (c & 0xF) >= radix)
+            return false;
+        acc = acc * radix + (c & 0xF);
+        if (acc > 0xFFFF) {
+            *overflow = true;
+            acc &= 0xFFFF;
+        }
+    }
+
+    *num = acc;
+    return true;
 }
 
 
+// Tokens one line can have, counting the T_NONE at the end.
+#define MAX_TOKENS 16
+
+
+// Parse the number t into tokens from token on, stopping short of end.
 static
-struct token* parse_number(struct token* token, const char* t, ssize_t toklen)
+struct token* parse_number(struct token* token, const struct token* end,
+        const char* t, ssize_t toklen, unsigned int l)
 {
+    bool overflow = false;
+
     if ('1' <= t[0] && t[0] <= '9') {
         token->type = T_NUMBER;
-        token->num = t[0] - '0';
-        for (ssize_t i = 1; i < toklen; ++i) {
-            if ('0' <= t[i] && t[i] <= '9')
-                token->num = token->num * 10 +
-                    t[i] - '0';
-            else if (t[i] != '_')
-                fatal(1, "Invalid decimal number");
-        }
+        if (!parse_digits(t, toklen, 10, &token->num, &overflow))
+            fatal(1, "Invalid decimal number");
         ++token;
     } else if (t[0] == '0') {
         token->type = T_NUMBER;
@@ -451,245 +401,216 @@ struct token* parse_number(struct token* token, const char* t, ssize_t toklen)
             ++token;
             return token;
         } else if (t[1] == 'b' || t[1] == 'n') {
-            t += 2;
-            toklen -= 2;
-            if (toklen == 0)
+            if (toklen == 2
+                    || !parse_digits(t + 2, toklen - 2, 2, &token->num,
+                        &overflow))
                 fatal(1, "Invalid binary number");
-
-            token->type = T_NUMBER;
-            token->num = 0;
-            for (ssize_t i = 0; i < toklen; ++i) {
-                if ('0' <= t[i] && t[i] <= '1')
-                    token->num = token->num * 2 +
-                        t[i] - '0';
-                else if (t[i] != '_')
-                    fatal(1, "Invalid binary number");
-            }
-            ++token;
         } else if ('0' <= t[1] && t[1] <= '7') {
-            ++t;
-            --toklen;
-            if (toklen == 0)
+            if (!parse_digits(t + 1, toklen - 1, 8, &token->num, &overflow))
                 fatal(1, "Invalid octal number");
-
-            token->type = T_NUMBER;
-            token->num = t[0] - '0';
-            for (ssize_t i = 1; i < toklen; ++i) {
-                if ('0' <= t[i] && t[i] <= '7')
-                    token->num = token->num * 8 +
-                        t[i] - '0';
-                else if (t[i] != '_')
-                    fatal(1, "Invalid octal number");
-            }
-            ++token;
         } else if (t[1] == 'x') {
-            t += 2;
-            toklen -= 2;
-            if (toklen == 0)
+            if (toklen == 2
+                    || !parse_digits(t + 2, toklen - 2, 16, &token->num,
+                        &overflow))
                 fatal(1, "Invalid hexadecimal number");
-
-            for (ssize_t i = 0; i < toklen; ++i) {
-                if ('0' <= t[i] && t[i] <= '9')
-                    token->num = token->num * 16 +
-                        t[i] - '0';
-                else if ('A' <= t[i] && t[i] <= 'F')
-                    token->num = token->num * 16 +
-                        t[i] - 'A' + 10;
-                else if ('a' <= t[i] && t[i] <= 'f')
-                    token->num = token->num * 16 +
-                        t[i] - 'a' + 10;
-                else if (t[i] != '_')
-                    fatal(1, "Invalid hexadecimal number");
-            }
-            ++token;
         } else {
             fatal(1, "Invalid number");
         }
-    } else if (t[0] == '#' && t[1] == '0') {
+        ++token;
+    } else if (toklen >= 3 && t[0] == '#' && t[1] == '0') {
+        // Each group of 8 binary or 2 hex digits (counted from the right)
+        // becomes its own number token.
+        ssize_t glen;
+        unsigned int radix;
+        const char* err;
         if (t[2] == 'b' || t[2] == 'n') {
-            t += 3;
-            toklen -= 3;
-            if (toklen == 0)
-                fatal(1, "Invalid binary number");
-
-            ssize_t gu = ((toklen - 1) % 8) + 1; // group upper bound
-            ssize_t i = 0;
-            do {
-                token->type = T_NUMBER;
-                token->num = 0;
-                for (/* */; i < gu; ++i) {
-                    if ('0' <= t[i] && t[i] <= '1')
-                        token->num = token->num * 2 +
-                            t[i] - '0';
-                    else if (t[i] != '_')
-                        fatal(1, "Invalid binary number");
-                }
-                ++token;
-
-                gu += 8;
-            } while (gu <= toklen);
+            glen = 8;
+            radix = 2;
+            err = "Invalid binary number";
         } else if (t[2] == 'x') {
-            t += 3;
-            toklen -= 3;
-            if (toklen == 0)
-                fatal(1, "Invalid hexadecimal number");
-
-            ssize_t gu = ((toklen - 1) % 2) + 1; // group upper bound
-            ssize_t i = 0;
-            do {
-                token->type = T_NUMBER;
-                token->num = 0;
-                for (/* */; i < gu; ++i) {
-                    if ('0' <= t[i] && t[i] <= '9')
-                        token->num = token->num * 16 +
-                            t[i] - '0';
-                    else if ('A' <= t[i] && t[i] <= 'F')
-                        token->num = token->num * 16 +
-                            t[i] - 'A' + 10;
-                    else if ('a' <= t[i] && t[i] <= 'f')
-                        token->num = token->num * 16 +
-                            t[i] - 'a' + 10;
-                    else if (t[i] != '_')
-                        fatal(1, "Invalid hexadecimal number");
-                }
-                ++token;
-
-                gu += 2;
-            } while (gu <= toklen);
+            glen = 2;
+            radix = 16;
+            err = "Invalid hexadecimal number";
         } else {
             fatal(1, "Invalid number");
         }
+        t += 3;
+        toklen -= 3;
+        if (toklen == 0)
+            fatal(1, err);
+
+        ssize_t gs = 0; // group start
+        ssize_t gu = ((toklen - 1) % glen) + 1; // group upper bound
+        do {
+            if (token == end)
+                fatal(1, "%u: Too many tokens", l);
+            token->type = T_NUMBER;
+            if (!parse_digits(&t[gs], gu - gs, radix, &token->num,
+                        &overflow))
+                fatal(1, err);
+            ++token;
+
+            gs = gu;
+            gu += glen;
+        } while (gu <= toklen);
+    } else {
+        fatal(1, "Invalid number");
     }
 
+    if (overflow)
+        fatal(1, "Number out of range");
+
     return token;
 }
 
 
+// Lex one line starting at *pos into up to cap tokens, leaving *pos at the
+// start of the next line. Returns false if there are no lines left.
 static
-void lex_line(struct token* token, const int src, unsigned int l,
-        size_t* const bufpos, size_t* const buflen)
+bool lex_line(struct emr* const ctx, struct token* token, size_t cap,
+        const struct srcbuf* const src, unsigned int l, size_t* const pos)
 {
-    size_t tokstart = *bufpos + 1;
-    char c;
-    ssize_t toklen;
-    bool first_buf = true;
-    unsigned int col = 1;
-    bool ignore = false;
+    const struct token* const end = &token[cap - 1]; // (for T_NONE)
+    const char* const text = src->data;
+    const size_t len = src->len;
+    const size_t linestart = *pos;
+
+    if (*pos >= len)
+        return false;
 
-    do {
+    while (true) {
         //
-        // Advance char.
+        // Find the end of the token.
         //
 
-        ++*bufpos;
-        if (*bufpos >= *buflen) {
-            if (fill_buffer(src, bufpos, buflen, &tokstart) == 0) {
-                if (first_buf)
-                    break;
-                else
-                    fatal(1, "%u,%u: Unexpected end of file", l, col);
-            }
-            first_buf = false;
-        }
-        c = buf[*bufpos];
-
-        if (ignore)
-            continue;
-
-        ++col;
-        toklen = *bufpos - tokstart;
+        size_t tokstart = *pos;
+        *pos += scan_sep(&text[*pos], len - *pos);
+        if (*pos >= len)
+            fatal(1, "%u,%zu: Unexpected end of file", l,
+                (*pos - linestart) + 1);
+        const char c = text[*pos];
+        size_t toklen = *pos - tokstart;
 
         //
-        // Process char.
+        // Process the token and separator.
         //
 
-        const bool is_sep = (strchr(":,; \t\n", c) != NULL);
-
-        if (is_sep) {
-            if (toklen > 0) {
-                char* t = &buf[tokstart];
-                if (
-                        ('A' <= t[0] && t[0] <= 'Z') ||
-                        ('a' <= t[0] && t[0] <= 'z') ||
-                        t[0] == '.' || t[0] == '_' || t[0] == '*' ||
-                        t[0] == '+' || t[0] == '-') {
-                    token->type = T_TEXT;
-                    token->text = malloc(toklen + 1);
-                    memcpy(token->text, t, toklen);
-                    token->text[toklen] = '\0';
-                    ++token;
-                } else if (t[0] == '#' || ('0' <= t[0] && t[0] <= '9')) {
-                    token = parse_number(token, t, toklen);
-                } else {
-                    fatal(1, "%u,%u: Invalid token", l, col);
-                }
+        if (toklen > 0) {
+            const char* t = &text[tokstart];
+            if (token == end)
+                fatal(1, "%u: Too many tokens", l);
+            if (
+                    ('A' <= t[0] && t[0] <= 'Z') ||
+                    ('a' <= t[0] && t[0] <= 'z') ||
+                    t[0] == '.' || t[0] == '_' || t[0] == '*' ||
+                    t[0] == '+' || t[0] == '-') {
+                token->type = T_TEXT;
+                token->text = t;
+                token->len = toklen;
+                token->sym = sym_intern(&ctx->syms, t, toklen);
+                ++token;
+            } else if (t[0] == '#' || ('0' <= t[0] && t[0] <= '9')) {
+                token = parse_number(token, end, t, toklen, l);
+            } else {
+                fatal(1, "%u,%zu: Invalid token", l,
+                    (*pos - linestart) + 2);
             }
+        }
 
-            if (c == ':') {
-                token->type = T_COLON;
-                token++;
-            } else if (c == ',') {
-                token->type = T_COMMA;
-                token++;
-            } else if (c == ';') {
-                ignore = true;
-            }
-        } else {
-            continue;
+        ++*pos;
+
+        if ((c == ':' || c == ',') && token == end)
+            fatal(1, "%u: Too many tokens", l);
+        if (c == ':') {
+            token->type = T_COLON;
+            token++;
+        } else if (c == ',') {
+            token->type = T_COMMA;
+            token++;
+        } else if (c == ';') {
+            *pos += scan_nl(&text[*pos], len - *pos);
+            if (*pos >= len)
+                fatal(1, "%u,%zu: Unexpected end of file", l,
+                    (*pos - linestart) + 1);
+            ++*pos;
+            break;
+        } else if (c == '\n') {
+            break;
         }
+    }
 
-        //
-        // Start new token.
-        //
+    token->type = T_NONE;
+    return true;
+}
 
-        tokstart = *bufpos + 1;
-    } while (c != '\n');
 
-    token->type = T_NONE;
+// What one line of source says by itself. Whether it's valid also depends
+// on the label (if any) pending from the lines before it; see check_label
+// and check_directive.
+struct parsed {
+    int label; // (this line's own)
+    bool has_insn;
+    struct line insn; // (next, label and num aren't set)
+};
+
+
+static inline
+void check_label(const struct parsed* const p, const int pending,
+        unsigned int l)
+{
+    if (p->label != SYM_NONE && pending != SYM_NONE)
+        fatal(1, "%u: Instruction already has a label", l);
+}
+
+
+static inline
+void check_directive(const struct parsed* const p, const int pending,
+        unsigned int l)
+{
+    const enum opcode opc = p->insn.oi->opc;
+    if ((p->label != SYM_NONE || pending != SYM_NONE) && C__LAST__ < opc
+            && opc < CD__LAST__)
+        fatal(1, "%u: Label not allowed on directive", l);
 }
 
 
 static
-struct line* parse_line(struct line* const prev_line,
-        const struct token* token, unsigned int l, char** const label)
+void parse_tokens(const struct token* token, unsigned int l,
+        const int pending, struct parsed* const p)
 {
+    *p = (struct parsed){ .label = SYM_NONE };
+
     if (token[0].type == T_NONE)
-        return prev_line;
+        return;
 
     if (token->type != T_TEXT)
         fatal(1, "%u: Expected label or opcode", l);
 
     if (token[1].type == T_COLON) {
-        if (*label != NULL)
-            fatal(1, "%u: Instruction already has a label", l);
-        *label = token->text;
+        p->label = token->sym;
+        check_label(p, pending, l);
         token += 2;
         if (token->type == T_NONE) {
-            return prev_line;
+            return;
         } else if (token->type != T_TEXT) {
             fatal(1, "%u: Expected opcode", l);
         }
     }
 
-    struct line* line = malloc(sizeof(struct line));
-    line->next = NULL;
-    if (prev_line != NULL)
-        prev_line->next = line;
-
-    line->label = *label;
-    *label = NULL;
+    struct line* line = &p->insn;
+    p->has_insn = true;
 
     line->star = (token->text[0] == '*');
-    struct insn* oi = dict_get(&insns, token->text + (line->star ? 1 : 0));
+    const struct insn* oi = insn_lookup(token->text + (line->star ? 1 : 0),
+        token->len - (line->star ? 1 : 0));
     if (oi == NULL)
-        fatal(1, "%u: Invalid opcode \"%s\"", l, token->text);
+        fatal(1, "%u: Invalid opcode \"%.*s\"", l, (int)token->len,
+            token->text);
     ++token;
 
     line->oi = oi;
 
-    if (line->label != NULL && C__LAST__ < line->oi->opc
-            && line->oi->opc < CD__LAST__)
-        fatal(1, "%u: Label not allowed on directive", l);
+    check_directive(p, pending, l);
 
     for (unsigned int i = 0; i < 2 && oi->opds[i] != 0; ++i) {
         struct operand* opd = &line->opds[i];
@@ -698,7 +619,7 @@ struct line* parse_line(struct line* const prev_line,
             if (token->type != T_COMMA) {
                 if (oi->opds[1] == D) {
                     opd->i = 1;
-                    opd->s = NULL;
+                    opd->sym = SYM_NONE;
                     break;
                 } else {
                     fatal(1, "%u: Expected comma", l);
@@ -709,9 +630,9 @@ struct line* parse_line(struct line* const prev_line,
 
         if (oi->opds[i] == F) {
             if (token->type == T_TEXT) {
-                opd->s = token->text;
+                opd->sym = token->sym;
             } else if (token->type == T_NUMBER) {
-                opd->s = NULL;
+                opd->sym = SYM_NONE;
                 opd->i = token->num;
             } else {
                 fatal(1, "%u: Expected register name or traditional "
@@ -722,11 +643,11 @@ struct line* parse_line(struct line* const prev_line,
                 if (token->num > 7)
                     fatal(1, "%u: Bit number out of range", l);
                 opd->i = token->num;
-                opd->s = NULL;
+                opd->sym = SYM_NONE;
             } else if (token->type == T_TEXT) {
                 if (line->star)
                     fatal(1, "%u: Expected bit number", l);
-                opd->s = token->text;
+                opd->sym = token->sym;
             } else {
                 fatal(1, "%u: Expected bit number or name", l);
             }
@@ -736,15 +657,15 @@ struct line* parse_line(struct line* const prev_line,
             else if (token->num >= 1<<oi->kwid)
                 fatal(1, "%u: Literal out of range", l);
             opd->i = token->num;
-            opd->s = NULL;
+            opd->sym = SYM_NONE;
         } else if (oi->opds[i] == L) {
             if (token->type == T_NUMBER) {
                 opd->i = token->num;
-                opd->s = NULL;
+                opd->sym = SYM_NONE;
                 if (token->num >= 1<<oi->kwid)
                     fatal(1, "%u: Literal out of range", l);
             } else if (token->type == T_TEXT) {
-                opd->s = token->text;
+                opd->sym = token->sym;
             } else {
                 fatal(1, "%u: Expected program label or literal", l);
             }
@@ -754,7 +675,7 @@ struct line* parse_line(struct line* const prev_line,
             else if (token->num > 1)
                 fatal(1, "%u: Destination select out of range", l);
             opd->i = token->num;
-            opd->s = NULL;
+            opd->sym = SYM_NONE;
         } else if (oi->opds[i] == T) {
             if (token->type != T_NUMBER)
                 fatal(1, "%u: Expected number", l); // TODO: Fix error.
@@ -762,19 +683,28 @@ struct line* parse_line(struct line* const prev_line,
                 fatal(1, "%u: Port %"PRIu16" out of range", l,
                     token->num);
             opd->i = token->num; // TODO: Verify or fix this.
-            opd->s = NULL;
+            opd->sym = SYM_NONE;
         } else if (oi->opds[i] == A) {
+            // (.reg with just a name leaves the bank to the assembler.)
+            if (oi->opc == CD_REG && token[0].type == T_TEXT &&
+                    token[1].type == T_NONE) {
+                opd->i = -1;
+                opd->sym = SYM_NONE;
+                line->opds[1].sym = token->sym;
+                ++token;
+                break;
+            }
             // TODO: Implement additional restrictions.
             if (token->type != T_NUMBER)
                 fatal(1, "%u: Expected bank number", l);
             opd->i = token->num;
-            opd->s = NULL;
+            opd->sym = SYM_NONE;
         } else if (oi->opds[i] == I) {
             if (token->type != T_TEXT)
                 fatal(1, "%u: Expected unused identifier", l);
-            opd->s = token->text;
+            opd->sym = token->sym;
         } else if (oi->opds[i] == N) {
-            if (token->type != T_TEXT || strlen(token->text) != 4)
+            if (token->type != T_TEXT || token->len != 4)
                 fatal(1, "%u: Expected indirect register", l);
 
             if (strncmp(token->text, "FSR", 3) != 0)
@@ -786,7 +716,7 @@ struct line* parse_line(struct line* const prev_line,
 
             line->opds[i].i = *fsr - '0';
         } else if (oi->opds[i] == M) {
-            if (token->type != T_TEXT || strlen(token->text) != 6)
+            if (token->type != T_TEXT || token->len != 6)
                 fatal(1, "%u: Expected indirect register", l);
 
             const char* fsr = NULL;
@@ -795,12 +725,12 @@ struct line* parse_line(struct line* const prev_line,
                 fsr = token->text + 3;
                 mode = token->text + 4;
                 line->opds[1].i = 2; // post-*
-                line->opds[1].s = NULL;
+                line->opds[1].sym = SYM_NONE;
             } else if (strncmp(token->text + 2, "FSR", 3) == 0) {
                 fsr = token->text + 5;
                 mode = token->text;
                 line->opds[1].i = 0; // pre-*
-                line->opds[1].s = NULL;
+                line->opds[1].sym = SYM_NONE;
             } else {
                 fatal(1, "%u: Expected indirect register", l);
             }
@@ -808,7 +738,7 @@ struct line* parse_line(struct line* const prev_line,
             if (*fsr != '0' && *fsr != '1')
                 fatal(1, "%u: FSR number out of range");
             line->opds[0].i = *fsr - '0';
-            line->opds[0].s = NULL;
+            line->opds[0].sym = SYM_NONE;
 
             if (mode[0] == '-' && mode[1] == '-')
                 line->opds[1].i |= 1; // *-decrement
@@ -821,311 +751,3697 @@ struct line* parse_line(struct line* const prev_line,
 
     if (token->type != T_NONE)
         fatal(1, "%u: Trailing tokens", l);
-
-    return line;
 }
 
 
-//// A1 (forward) ////
-// .___ : process, remove
-// ___f___ : insert movlb if bank not active
-// [*]___f___ : resolve
-// bra : change to goto if target far, star if target near
-// call, goto : insert movlp
+// Add a parsed line to the list, giving it the pending label if it doesn't
+// have its own. Returns the new last line.
 static
-struct line* assemble_pass1(struct line* start, int16_t* cfg)
+struct line* attach_line(struct emr* const ctx, struct line* const prev_line,
+        const struct parsed* const p, int* const label)
 {
-    for (unsigned int i = 0; i < CFG_MEM_SIZE; ++i)
-        cfg[i] = -1;
-
-    int* autoaddr = NULL;
-    int autobankmin;
-    int autobankmax;
-    int autoaddrmax;
-    int cautoaddr = 0x70;
-
-    dict_init(&labels);
-    dict_init(&regs);
-    dict_init(&cregs);
-    for (unsigned int i = 0; i < lengthof(cregs_ref); ++i)
-        *(struct creg*)dict_avail(&cregs, cregs_ref[i].name) = cregs_ref[i];
-
-    struct insn* oi_goto = dict_get(&insns, "goto");
-    struct insn* oi_movlb = dict_get(&insns, "movlb");
-    struct insn* oi_movlp = dict_get(&insns, "movlp");
-
-    int addr = 0;
-    int bsr = INT_MAX;
-    struct line* prev = NULL;
-    struct line* line = start;
-    while (line != NULL) {
-        enum opcode opc = line->oi->opc;
-
-        // Handle directives.
-        if (opc == CD_GPR) {
-            autobankmin = line->opds[0].i >> 7;
-            autobankmax = line->opds[1].i >> 7;
-
-            autoaddr = malloc((autobankmax - autobankmin + 1) * sizeof(int));
-            autoaddr[0] = line->opds[0].i & 0x7F;
-            for (int b = 1; b < autobankmax - autobankmin + 1; ++b)
-                autoaddr[b] = 0x20;
-            autoaddrmax = line->opds[1].i & 0x7F;
-        } else if (opc == CD_SFR) {
-            struct reg* reg = dict_avail(&regs, line->opds[1].s);
-            reg->bank = line->opds[0].i >> 7;
-            reg->addr = line->opds[0].i & 0x7F;
-            reg->name = line->opds[1].s;
-        } else if (opc == CD_REG) {
-            int b = line->opds[0].i;
-            if ( !(autobankmin <= b && b <= autobankmax) )
-                fatal(E_COMMON, "%u: Bank number %d out of range", line->num,
-                    b);
-            int* a = &(autoaddr[b - autobankmin]);
-            if (*a > 0x6F || (b == autobankmax && *a > autoaddrmax))
-                fatal(E_COMMON, "%u: No GPR left in bank %d", line->num, b);
-
-            struct reg* reg = dict_avail(&regs, line->opds[1].s);
-            reg->bank = b;
-            reg->addr = *a;
-            reg->name = line->opds[1].s;
-
-            ++*a;
-        } else if (opc == CD_CREG) {
-            if (cautoaddr > 0x7F)
-                fatal(E_COMMON, "%u: No common registers left", line->num);
-            struct creg* creg = dict_avail(&cregs, line->opds[0].s);
-            creg->addr = cautoaddr++;
-            creg->name = line->opds[0].s;
-        } else if (opc == CD_CFG) {
-            int addr = line->opds[0].i - 0x8000;
-            if (addr < 0 || addr >= 0xF)
-                fatal(E_COMMON, "%u: Address out of range", line->num);
-            if (cfg[addr] >= 0)
-                fatal(E_COMMON, "%u: Configuration word already set",
-                    line->num);
-            cfg[addr] = line->opds[1].i;
-        }
+    if (p->label != SYM_NONE)
+        *label = p->label;
+    if (!p->has_insn)
+        return prev_line;
 
-        // Store label info.
-        if (line->label != NULL) {
-            struct label* li = dict_avail(&labels, line->label);
-            li->name = line->label;
-            li->addr = addr;
-            bsr = INT_MAX;
-        }
-
-        // Resolve register names.
-        bool is_f = (
-            (C_ADDWF <= opc && opc <= C_CLRF) ||
-            (C_COMF <= opc && opc <= C_BTFSS)
-        );
-        if (is_f) {
-            if (line->opds[0].s != NULL) {
-                struct reg* reg = dict_get(&regs, line->opds[0].s);
-                if (reg == NULL) {
-                    struct creg* creg = dict_get(&cregs, line->opds[0].s);
-                    if (creg == NULL)
-                        fatal(E_COMMON, "%u: Unknown register name",
-                            line->num);
-                    line->opds[0].i = creg->addr;
-                    line->opds[0].s = NULL;
-                } else {
-                    line->opds[0].i = reg->addr;
-                    line->opds[0].s = NULL;
-                    if (reg->bank != bsr) {
-                        if (line->star) {
-                            if (bsr != INT_MAX)
-                                fatal(E_COMMON,
-                                    "%u: Bank %d is active; star prevents "
-                                    "changing to bank %d", line->num, bsr,
-                                    reg->bank);
-                        } else {
-                            struct line* new = insert_line(line);
-                            new->next = prev;
-                            new->oi = oi_movlb;
-                            new->star = false;
-                            new->opds[0].i = reg->bank;
-                            new->opds[0].s = NULL;
-
-                            if (verbosity >= 2) {
-                                printf("[0x%04X] ", addr);
-                                print_line(new);
-                                putchar('\n');
-                            }
-
-                            ++addr;
-                            prev = new;
-                        }
-
-                        bsr = reg->bank;
-                    }
-                }
-                line->opds[0].s = NULL;
-            } else {
-                line->opds[0].i &= 0x7F;
-            }
-        }
+    struct line* line = arena_alloc(&ctx->arena, sizeof(struct line));
+    *line = p->insn;
+    line->next = NULL;
+    if (prev_line != NULL)
+        prev_line->next = line;
 
-        if (opc == C_MOVLB) {
-            if (line->opds[0].s != NULL) {
-                struct reg* reg = dict_get(&regs, line->opds[0].s);
-                if (reg == NULL)
-                    fatal(E_COMMON, "%u: Unknown register name", line->num);
-                line->opds[0].i = reg->bank;
-                line->opds[0].s = NULL;
-            }
-            bsr = line->opds[0].i;
-        }
-
-        // Handle bra.
-        if (opc == C_BRA) {
-            struct label* li = dict_get(&labels, line->opds[0].s);
-            if (li != NULL) {
-                if ((addr + 1) - li->addr > 256) { // reverse limit
-                    if (line->star)
-                        fatal(E_COMMON, "%u: Target out of range", line->num);
-                    opc = C_GOTO;
-                    line->oi = oi_goto;
-                } else {
-                    line->star = true;
-                }
-            }
-        }
+    line->label = *label;
+    *label = SYM_NONE;
 
-        if ((opc == C_GOTO || opc == C_CALL) && !line->star) {
-            struct line* new = insert_line(line);
-            new->next = prev;
-            new->oi = oi_movlp;
-            new->star = false;
-            new->opds[0].i = line->opds[0].i;
-            new->opds[0].s = line->opds[0].s;
+    return line;
+}
 
-            if (verbosity >= 2) {
-                printf("[0x%04X] ", addr);
-                print_line(new);
-                putchar('\n');
-            }
 
-            ++addr;
-            prev = new;
-        }
+// Parsed lines from earlier assemblies, keyed by their text. While a cache
+// is in use, symbol IDs have to mean the same thing from one assembly to
+// the next, so the symbol table is kept in the cache's arena rather than
+// being rebuilt each time. The passes don't use the cache at all; they run
+// in full every time, so the output can't differ from an uncached build.
+struct line_cache {
+    struct arena arena; // (keys and symbol names)
+    struct dict lines; // text -> struct parsed
+    size_t max_lines;
+};
 
-        if (opc == C_CALL || opc == C_CALLW) {
-            bsr = INT_MAX;
-        }
 
-        if (verbosity >= 2) {
-            printf("[0x%04X] ", addr);
-            print_line(line);
-            putchar('\n');
-        }
+// Drop everything, including the symbol table.
+static
+void cache_reset(struct emr* const ctx)
+{
+    struct line_cache* const cache = ctx->cache;
+    dict_clear(&cache->lines);
+    arena_reset(&cache->arena);
+    sym_init(&ctx->syms, &cache->arena);
+}
 
-        // Increment address.
-        if ( !(C__LAST__ < opc && opc <= CD__LAST__) )
-            ++addr;
 
-        // Advance to next line.
-        {
-            struct line* old_next = line->next;
-            if ( !(C__LAST__ < opc && opc <= CD__LAST__) ) {
-                line->next = prev;
-                prev = line;
-            }
-            line = old_next;
-        }
+// Lex and parse the line at *pos, or reuse what was found for the same text
+// last time. Returns false if there are no lines left.
+static
+bool cached_parse(struct emr* const ctx, const struct srcbuf* const src,
+        unsigned int l, size_t* const pos, const int pending,
+        struct parsed* const p)
+{
+    if (*pos >= src->len)
+        return false;
+
+    const char* const text = &src->data[*pos];
+    size_t len = scan_nl(text, src->len - *pos);
+
+    const struct parsed* hit = NULL;
+    if (len < src->len - *pos)
+        hit = dict_get(&ctx->cache->lines, text, len);
+    if (hit != NULL) {
+        *p = *hit;
+        check_label(p, pending, l);
+        if (p->has_insn)
+            check_directive(p, pending, l);
+        *pos += len + 1;
+        return true;
     }
 
-    if (verbosity >= 2)
-        putchar('\n');
+    // (This is also how a last line without a newline gets its error.)
+    struct token tokens[MAX_TOKENS];
+    lex_line(ctx, tokens, lengthof(tokens), src, l, pos);
+    parse_tokens(tokens, l, pending, p);
 
-    return prev;
+    char* key = arena_alloc(&ctx->cache->arena, len);
+    memcpy(key, text, len);
+    *(struct parsed*)dict_avail(&ctx->cache->lines, key, len) = *p;
+    return true;
 }
 
 
-//// A2 (reverse) ////
-// bra : change to goto if target far or not seen
-// label : store
-static
-struct line* assemble_pass2(struct line* start, int* len)
+static inline
+bool gpr_full(const struct gpr_space* const space, int b)
 {
-    dict_init(&labels);
+    int a = space->next[b - space->bankmin];
+    return a > 0x6F || (b == space->bankmax && a > space->addrmax);
+}
 
-    struct insn* oi_goto = dict_get(&insns, "goto");
-    struct insn* oi_movlp = dict_get(&insns, "movlp");
 
+// Whether the first operand of an instruction is a register.
+static inline
+bool has_f(enum opcode opc)
+{
+    return (C_ADDWF <= opc && opc <= C_CLRF) ||
+        (C_COMF <= opc && opc <= C_BTFSS);
+}
+
+
+static inline
+bool is_skip(enum opcode opc)
+{
+    return opc == C_DECFSZ || opc == C_INCFSZ || opc == C_BTFSC ||
+        opc == C_BTFSS;
+}
+
+
+// Whether execution can go on to the next line.
+static inline
+bool falls_through(enum opcode opc)
+{
+    return !(opc == C_BRA || opc == C_BRW || opc == C_GOTO ||
+        opc == C_RETFIE || opc == C_RETLW || opc == C_RETURN ||
+        opc == C_RESET);
+}
+
+
+// Whether the line writes the core register at addr, which is mapped into
+// every bank.
+static inline
+bool writes_creg(const struct line* line, int addr)
+{
+    enum opcode opc = line->oi->opc;
+    bool writes_f = (
+        (C_ADDWF <= opc && opc <= C_CLRF) ||
+        (C_COMF <= opc && opc <= C_BSF)
+    );
+    if (!writes_f || line->opds[0].i != addr)
+        return false;
+    return line->oi->opds[1] != D || line->opds[1].i == 1;
+}
+
+
+// A .reg without a bank, waiting for a place.
+struct auto_reg {
+    int sym;
+    unsigned int num; // (line it was declared on)
+    uint64_t weight; // (accesses, weighted by loop depth)
+    bool common; // (whether it went to common RAM)
+    bool movlb; // (whether a movlb names it, so it needs a bank)
+    size_t group; // (representative of the registers it has to share a
+                  // bank with)
+    size_t next; // (next register in the same group, or SIZE_MAX)
+};
+
+
+// Two registers used one after the other, where a movlb would go between
+// them if they were in different banks. Banks are numbered after the
+// registers.
+struct reg_pair {
+    size_t u;
+    size_t v;
+    uint64_t w;
+    bool skip; // (whether they are in the same skip chain)
+};
+
+
+// Something to sort by a key, such as a register or an edge by its
+// weight.
+struct rank {
+    uint64_t key;
+    size_t idx;
+};
+
+
+// Largest key first, then lowest index.
+static
+int compare_rank_desc(const void* a, const void* b)
+{
+    const struct rank* ra = a;
+    const struct rank* rb = b;
+    if (ra->key != rb->key)
+        return (ra->key < rb->key) ? 1 : -1;
+    return (ra->idx > rb->idx) - (ra->idx < rb->idx);
+}
+
+
+static
+size_t find_group(size_t* const parent, size_t x)
+{
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+
+// Index the lines of a list and their labels, returning how many lines
+// there are.
+static
+size_t line_array(struct emr* const ctx, struct line* const start,
+        struct line*** const lines, int** const label_idx)
+{
+    size_t n = 0;
+    for (struct line* line = start; line != NULL; line = line->next)
+        ++n;
+
+    *lines = arena_alloc(&ctx->arena, n * sizeof(struct line*));
+    *label_idx = arena_alloc(&ctx->arena,
+        sym_count(&ctx->syms) * sizeof(int));
+
+    for (size_t i = 0; i < sym_count(&ctx->syms); ++i)
+        (*label_idx)[i] = -1;
+    size_t i = 0;
+    for (struct line* line = start; line != NULL; line = line->next, ++i) {
+        (*lines)[i] = line;
+        if (line->label != SYM_NONE)
+            (*label_idx)[line->label] = i;
+    }
+
+    return n;
+}
+
+
+// Index the lines of a list built in reverse, as pass 1 leaves it, and
+// their labels, returning how many lines there are.
+static
+size_t rev_line_array(struct emr* const ctx, struct line* const rev,
+        struct line*** const lines, int** const label_idx)
+{
+    size_t n = 0;
+    for (struct line* line = rev; line != NULL; line = line->next)
+        ++n;
+
+    *lines = arena_alloc(&ctx->arena, n * sizeof(struct line*));
+    *label_idx = arena_alloc(&ctx->arena,
+        sym_count(&ctx->syms) * sizeof(int));
+
+    for (size_t i = 0; i < sym_count(&ctx->syms); ++i)
+        (*label_idx)[i] = -1;
+    size_t i = n;
+    for (struct line* line = rev; line != NULL; line = line->next) {
+        (*lines)[--i] = line;
+        if (line->label != SYM_NONE)
+            (*label_idx)[line->label] = i;
+    }
+
+    return n;
+}
+
+
+// Loops more deeply nested than this all weigh the same.
+#define MAX_LOOP_DEPTH 5
+
+
+// Weigh each line by how often it might run: 8 times as much for each loop
+// it's in, a loop being the lines from a label back to a jump to it.
+static
+void loop_weights(struct emr* const ctx, struct line** const lines,
+        const size_t n, const int* const label_idx, uint64_t* const weight)
+{
+    int* depth = arena_alloc(&ctx->arena, (n + 1) * sizeof(int));
+
+    size_t i;
+    for (i = 0; i <= n; ++i)
+        depth[i] = 0;
+    for (i = 0; i < n; ++i) {
+        enum opcode opc = lines[i]->oi->opc;
+        int sym = lines[i]->opds[0].sym;
+        if ((opc == C_BRA || opc == C_GOTO) && sym != SYM_NONE &&
+                label_idx[sym] >= 0 && (size_t)label_idx[sym] <= i) {
+            ++depth[label_idx[sym]];
+            --depth[i + 1];
+        }
+    }
+
+    int level = 0;
+    for (i = 0; i < n; ++i) {
+        level += depth[i];
+        weight[i] = (uint64_t)1 << (3 * min(level, MAX_LOOP_DEPTH));
+    }
+}
+
+
+// Place each .reg without a bank and resolve the lines using it. Every
+// access counts as much as loop_weights() says. The registers used most go
+// into whatever common RAM .gpr takes in and neither .creg nor a line
+// naming the address has, unless a movlb names them. A skip and the line it
+// skips can't have a movlb between them, so the registers they use are
+// placed together.
+// Then, most used first, each goes into the bank it was used next to most,
+// counting registers already placed and fixed banks.
+static
+void place_regs(struct emr* const ctx, struct line* const rev,
+        struct gpr_space* const space, int* const cautoaddr,
+        struct auto_reg* const autos, const size_t nauto,
+        const int* const auto_idx)
+{
+    struct line** lines;
+    int* label_idx;
+    size_t n = rev_line_array(ctx, rev, &lines, &label_idx);
+
+    // Weigh the accesses.
+    uint64_t* weight = arena_alloc(&ctx->arena, n * sizeof(uint64_t));
+    loop_weights(ctx, lines, n, label_idx, weight);
+    unsigned int used = 0; // (common RAM named by address)
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        enum opcode opc = lines[i]->oi->opc;
+        int sym = lines[i]->opds[0].sym;
+        if ((has_f(opc) || opc == C_MOVLB) && sym != SYM_NONE)
+            autos[auto_idx[sym]].weight += weight[i];
+        if (opc == C_MOVLB && sym != SYM_NONE)
+            autos[auto_idx[sym]].movlb = true;
+        if (has_f(opc) && sym == SYM_NONE && lines[i]->opds[0].i >= 0x70)
+            used |= 1u << (lines[i]->opds[0].i - 0x70);
+    }
+
+    struct rank* rank = arena_alloc(&ctx->arena,
+        nauto * sizeof(struct rank));
+    for (i = 0; i < nauto; ++i)
+        rank[i] = (struct rank){ .key = autos[i].weight, .idx = i };
+    qsort(rank, nauto, sizeof(struct rank), compare_rank_desc);
+
+    for (i = 0; i < nauto; ++i) {
+        struct auto_reg* ar = &autos[rank[i].idx];
+        if (ar->weight == 0)
+            break;
+        if (ar->movlb)
+            continue;
+        while (*cautoaddr <= 0x7F &&
+                !(space->common & ~used & 1u << (*cautoaddr - 0x70)))
+            ++*cautoaddr;
+        if (*cautoaddr > 0x7F)
+            break;
+        struct creg* creg = &ctx->creg_array[ar->sym];
+        creg->addr = (*cautoaddr)++;
+        creg->name = sym_name(&ctx->syms, ar->sym);
+        ctx->reg_array[ar->sym].bank = -1;
+        ar->common = true;
+    }
+
+    // Pair up the banked accesses left.
+    const size_t nbanks = space->bankmax - space->bankmin + 1;
+    struct reg_pair* pairs = arena_alloc(&ctx->arena,
+        n * sizeof(struct reg_pair));
+    size_t npairs = 0;
+    size_t last = SIZE_MAX;
+    size_t last_i = 0;
+    size_t group_i = 0; // (first line of the current skip chain)
+    for (i = 0; i < n; ++i) {
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+
+        if (i == 0 || !is_skip(lines[i - 1]->oi->opc))
+            group_i = i;
+
+        size_t cur = SIZE_MAX;
+        int b = -1;
+        if (has_f(opc) || opc == C_MOVLB) {
+            if (line->opds[0].sym != SYM_NONE) {
+                cur = auto_idx[line->opds[0].sym];
+                if (autos[cur].common)
+                    cur = SIZE_MAX;
+            } else if (opc == C_MOVLB) {
+                b = line->opds[0].i;
+            } else {
+                b = line->bank;
+            }
+        }
+        if (space->bankmin <= b && b <= space->bankmax)
+            cur = nauto + (b - space->bankmin);
+
+        if (cur != SIZE_MAX) {
+            if (last != SIZE_MAX && last != cur && (last < nauto ||
+                    cur < nauto))
+                pairs[npairs++] = (struct reg_pair){
+                    .u = min(last, cur), .v = max(last, cur),
+                    .w = weight[i], .skip = (last_i >= group_i) };
+            last = cur;
+            last_i = i;
+        }
+        if (!falls_through(opc) || opc == C_CALL || opc == C_CALLW)
+            last = SIZE_MAX;
+    }
+
+    // Group the registers that have to share a bank, and find out how
+    // much each one gains from going into each bank.
+    size_t* parent = arena_alloc(&ctx->arena,
+        (nauto + nbanks) * sizeof(size_t));
+    uint64_t* gain = arena_alloc(&ctx->arena,
+        nauto * nbanks * sizeof(uint64_t));
+    for (i = 0; i < nauto + nbanks; ++i)
+        parent[i] = i;
+    for (i = 0; i < nauto * nbanks; ++i)
+        gain[i] = 0;
+    for (i = 0; i < npairs; ++i) {
+        const struct reg_pair* pair = &pairs[i];
+        if (pair->skip) {
+            // (A fixed bank stays the root; two fixed banks can't be
+            // joined, and A1b reports that.)
+            size_t ru = find_group(parent, pair->u);
+            size_t rv = find_group(parent, pair->v);
+            if (ru < nauto)
+                parent[ru] = rv;
+            else if (rv < nauto)
+                parent[rv] = ru;
+        }
+        if (pair->v >= nauto)
+            gain[pair->u * nbanks + (pair->v - nauto)] += pair->w;
+    }
+
+    // (A group's weight is the sum of its registers'.)
+    uint64_t* group_weight = arena_alloc(&ctx->arena,
+        (nauto + nbanks) * sizeof(uint64_t));
+    size_t* group_first = arena_alloc(&ctx->arena,
+        (nauto + nbanks) * sizeof(size_t));
+    for (i = 0; i < nauto + nbanks; ++i) {
+        group_weight[i] = 0;
+        group_first[i] = SIZE_MAX;
+    }
+    for (i = nauto; i-- > 0; /* */) {
+        struct auto_reg* ar = &autos[i];
+        ar->group = find_group(parent, i);
+        ar->next = group_first[ar->group];
+        group_first[ar->group] = i;
+        group_weight[ar->group] += ar->weight;
+    }
+    for (i = 0; i < nauto; ++i)
+        rank[i] = (struct rank){ .key = group_weight[autos[i].group],
+            .idx = i };
+    qsort(rank, nauto, sizeof(struct rank), compare_rank_desc);
+
+    for (size_t r = 0; r < nauto; ++r) {
+        const size_t group = autos[rank[r].idx].group;
+        if (autos[rank[r].idx].common || group_first[group] == SIZE_MAX)
+            continue;
+
+        size_t size = 0;
+        for (size_t u = group_first[group]; u != SIZE_MAX;
+                u = autos[u].next)
+            size += !autos[u].common;
+
+        // A group tied to a fixed bank has to go there.
+        size_t best = SIZE_MAX;
+        uint64_t best_gain = 0;
+        for (size_t b = 0; b < nbanks; ++b) {
+            if (group >= nauto && b != group - nauto)
+                continue;
+            int end = (space->bankmin + (int)b == space->bankmax)
+                ? min(space->addrmax, 0x6F) : 0x6F;
+            int left = end + 1 - space->next[b];
+            if (left < (int)size)
+                continue;
+            uint64_t g = 0;
+            for (size_t u = group_first[group]; u != SIZE_MAX;
+                    u = autos[u].next)
+                if (!autos[u].common)
+                    g += gain[u * nbanks + b];
+            if (best == SIZE_MAX || g > best_gain) {
+                best = b;
+                best_gain = g;
+            }
+        }
+
+        for (size_t u = group_first[group]; u != SIZE_MAX;
+                u = autos[u].next) {
+            if (autos[u].common)
+                continue;
+            if (best == SIZE_MAX)
+                fatal(E_COMMON, "%u: No GPR left", autos[u].num);
+
+            struct reg* reg = &ctx->reg_array[autos[u].sym];
+            reg->bank = space->bankmin + best;
+            reg->addr = space->next[best]++;
+
+            for (size_t e = 0; e < npairs; ++e) {
+                const struct reg_pair* pair = &pairs[e];
+                if (pair->u == u && pair->v < nauto)
+                    gain[pair->v * nbanks + best] += pair->w;
+                else if (pair->v == u)
+                    gain[pair->u * nbanks + best] += pair->w;
+            }
+        }
+        group_first[group] = SIZE_MAX;
+    }
+
+    if (ctx->verbosity >= 2) {
+        for (i = 0; i < nauto; ++i) {
+            int sym = autos[i].sym;
+            if (autos[i].common)
+                fprintf(ctx->list, "%s: 0x%02X\n", sym_name(&ctx->syms, sym),
+                    ctx->creg_array[sym].addr);
+            else
+                fprintf(ctx->list, "%s: 0x%03X\n", sym_name(&ctx->syms, sym),
+                    ctx->reg_array[sym].bank << 7 | ctx->reg_array[sym].addr);
+        }
+        fputc('\n', ctx->list);
+    }
+
+    // Resolve the lines.
+    for (i = 0; i < n; ++i) {
+        struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+        int sym = line->opds[0].sym;
+
+        if (!(has_f(opc) || opc == C_MOVLB) || sym == SYM_NONE)
+            continue;
+        const struct auto_reg* ar = &autos[auto_idx[sym]];
+
+        if (opc == C_MOVLB) {
+            if (ar->common)
+                fatal(E_COMMON, "%u: Register is in common RAM", line->num);
+            line->opds[0].i = ctx->reg_array[sym].bank;
+        } else if (ar->common) {
+            line->opds[0].i = ctx->creg_array[sym].addr;
+        } else {
+            line->opds[0].i = ctx->reg_array[sym].addr;
+            line->bank = ctx->reg_array[sym].bank;
+        }
+        line->opds[0].sym = SYM_NONE;
+    }
+}
+
+
+// Whether a goto or call gets a movlp until the layout says otherwise.
+static inline
+bool is_far(const struct line* line)
+{
+    enum opcode opc = line->oi->opc;
+    return (opc == C_GOTO || opc == C_CALL) && !line->star;
+}
+
+
+// For the brw of a .table, the first goto in it, whose page it selects for
+// all of them; otherwise -1.
+static inline
+int table_goto(struct line** const lines, const size_t n, const size_t i)
+{
+    if (lines[i]->oi->opc != C_BRW)
+        return -1;
+    for (size_t j = i + 1; j < n && j <= i + lines[i]->opds[1].i; ++j)
+        if (lines[j]->oi->opc == C_GOTO)
+            return j;
+    return -1;
+}
+
+
+// Words a line takes before layout: one, plus one for the movlp that each
+// far jump and .table brw has until the layout says otherwise, which goes
+// in above any skips before it, so counts for the first of them.
+static inline
+int line_words(struct line** const lines, const size_t n, const size_t i)
+{
+    if (i > 0 && is_skip(lines[i - 1]->oi->opc))
+        return 1;
+    size_t j = i;
+    while (j + 1 < n && is_skip(lines[j]->oi->opc))
+        ++j;
+    return (is_far(lines[j]) || table_goto(lines, n, j) >= 0) ? 2 : 1;
+}
+
+
+// Line at the interrupt vector (the first to end past address 4, counting
+// words as line_words does), or SIZE_MAX if there's no interrupt routine.
+static
+size_t vector_line(struct line** const lines, const size_t n)
+{
+    bool has_isr = false;
+    size_t i;
+    for (i = 0; i < n; ++i)
+        if (lines[i]->oi->opc == C_RETFIE)
+            has_isr = true;
     int addr = 0;
+    for (i = 0; has_isr && i < n; ++i) {
+        addr += line_words(lines, n, i);
+        if (addr > 4)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+
+// A subroutine: the lines reached from its entry without going into calls
+// or into another entry.
+struct proc {
+    size_t entry; // (line index)
+    bool main; // (whether it can run after reset)
+    bool isr; // (whether it can run in the interrupt routine)
+};
+
+
+// One subroutine starting another. Falling or jumping into another entry
+// counts too, but that doesn't use the hardware stack.
+struct call_edge {
+    size_t from;
+    size_t to;
+    bool call;
+    size_t line; // (index of the line it happens at)
+};
+
+
+struct callgraph {
+    struct proc* procs;
+    size_t nprocs;
+    int* proc_at; // (proc entered at each line, or -1)
+    struct call_edge* edges;
+    size_t nedges;
+    size_t main; // (proc at reset, or SIZE_MAX if there are no lines)
+    size_t isr; // (proc at the interrupt vector, or SIZE_MAX)
+    bool computed; // (whether anything calls or jumps to a computed
+                   // address, which the graph can't follow)
+};
+
+
+static
+void add_edge(struct emr* const ctx, struct callgraph* const cg,
+        size_t* const cap, const struct call_edge edge)
+{
+    if (cg->nedges == *cap) {
+        struct call_edge* edges = arena_alloc(&ctx->arena,
+            2 * *cap * sizeof(struct call_edge));
+        memcpy(edges, cg->edges, cg->nedges * sizeof(struct call_edge));
+        cg->edges = edges;
+        *cap *= 2;
+    }
+    cg->edges[cg->nedges++] = edge;
+}
+
+
+// Build the call graph. Reset, the interrupt vector and call targets are
+// entries, and so are the lines marked in is_entry (if given).
+static
+void callgraph_build(struct emr* const ctx, struct callgraph* const cg,
+        struct line** const lines, const size_t n, const int* const label_idx,
+        const bool* const is_entry)
+{
+    cg->proc_at = arena_alloc(&ctx->arena, n * sizeof(int));
+    cg->procs = arena_alloc(&ctx->arena, n * sizeof(struct proc));
+    cg->nprocs = 0;
+    size_t cap = n + 1;
+    cg->edges = arena_alloc(&ctx->arena, cap * sizeof(struct call_edge));
+    cg->nedges = 0;
+    cg->computed = false;
+
+    size_t isr = vector_line(lines, n);
+    bool* entry = arena_alloc(&ctx->arena, n * sizeof(bool));
+    size_t i;
+    for (i = 0; i < n; ++i)
+        entry[i] = (i == 0 || i == isr || (is_entry != NULL && is_entry[i]));
+    for (i = 0; i < n; ++i) {
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+
+        if (opc == C_CALLW || writes_creg(line, 0x02))
+            cg->computed = true;
+        if (opc == C_BRA || opc == C_GOTO || opc == C_CALL) {
+            int sym = line->opds[0].sym;
+            if (sym == SYM_NONE)
+                cg->computed = true;
+            else if (opc == C_CALL && label_idx[sym] >= 0)
+                entry[label_idx[sym]] = true;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        cg->proc_at[i] = entry[i] ? (int)cg->nprocs : -1;
+        if (entry[i])
+            cg->procs[cg->nprocs++] = (struct proc){ .entry = i };
+    }
+    cg->main = (n > 0) ? 0 : SIZE_MAX;
+    cg->isr = (isr != SIZE_MAX) ? (size_t)cg->proc_at[isr] : SIZE_MAX;
+
+    // Walk each subroutine.
+    size_t* seen = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    size_t* work = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    for (i = 0; i < n; ++i)
+        seen[i] = SIZE_MAX;
+    for (size_t p = 0; p < cg->nprocs; ++p) {
+        size_t top = 0;
+        work[top++] = cg->procs[p].entry;
+        seen[cg->procs[p].entry] = p;
+
+        while (top > 0) {
+            i = work[--top];
+            const struct line* line = lines[i];
+            enum opcode opc = line->oi->opc;
+
+            int tgt = -1;
+            if ((opc == C_BRA || opc == C_GOTO || opc == C_CALL) &&
+                    line->opds[0].sym != SYM_NONE)
+                tgt = label_idx[line->opds[0].sym];
+            if (opc == C_CALL) {
+                if (tgt >= 0)
+                    add_edge(ctx, cg, &cap, (struct call_edge){ .from = p,
+                        .to = cg->proc_at[tgt], .call = true, .line = i });
+                tgt = -1;
+            }
+
+            // (brw goes into the table after it, as in flow_run.)
+            size_t next[3];
+            size_t nnext = 0;
+            if (falls_through(opc) && i + 1 < n)
+                next[nnext++] = i + 1;
+            if (is_skip(opc) && i + 2 < n)
+                next[nnext++] = i + 2;
+            if (tgt >= 0)
+                next[nnext++] = tgt;
+            size_t table_end = i;
+            if (opc == C_BRW)
+                while (table_end + 1 < n &&
+                        (table_end == i ||
+                        !falls_through(lines[table_end]->oi->opc)))
+                    ++table_end;
+
+            for (size_t k = 0; k < nnext + (table_end - i); ++k) {
+                size_t j = (k < nnext) ? next[k] : i + 1 + (k - nnext);
+                if (seen[j] == p)
+                    continue;
+                seen[j] = p;
+                if (cg->proc_at[j] >= 0)
+                    add_edge(ctx, cg, &cap, (struct call_edge){ .from = p,
+                        .to = cg->proc_at[j], .call = false, .line = i });
+                else
+                    work[top++] = j;
+            }
+        }
+    }
+
+    // Find what can run from reset and what from the interrupt vector.
+    if (cg->main != SIZE_MAX)
+        cg->procs[cg->main].main = true;
+    if (cg->isr != SIZE_MAX)
+        cg->procs[cg->isr].isr = true;
+    for (bool changed = true; changed; /* */) {
+        changed = false;
+        for (size_t e = 0; e < cg->nedges; ++e) {
+            const struct proc* from = &cg->procs[cg->edges[e].from];
+            struct proc* to = &cg->procs[cg->edges[e].to];
+            if ((from->main && !to->main) || (from->isr && !to->isr)) {
+                to->main |= from->main;
+                to->isr |= from->isr;
+                changed = true;
+            }
+        }
+    }
+}
+
+
+// A .local, waiting for its subroutine's frame to be placed.
+struct local {
+    int sym;
+    int sub; // (label of its subroutine)
+    unsigned int num; // (line it was declared on)
+};
+
+
+// Raise the offset of each subroutine's frame above the frames of those
+// that can start it, among those for which in() is true. Returns false if
+// that never settles, which means there's recursion through locals.
+static
+bool raise_frames(const struct callgraph* const cg, const size_t* const size,
+        size_t* const offset, bool (*in)(const struct proc*))
+{
+    for (size_t round = 0; round <= cg->nprocs; ++round) {
+        bool changed = false;
+        for (size_t e = 0; e < cg->nedges; ++e) {
+            const struct call_edge* edge = &cg->edges[e];
+            if (!in(&cg->procs[edge->from]) || !in(&cg->procs[edge->to]))
+                continue;
+            size_t top = offset[edge->from] + size[edge->from];
+            if (top > offset[edge->to]) {
+                offset[edge->to] = top;
+                changed = true;
+            }
+        }
+        if (!changed)
+            return true;
+    }
+    return false;
+}
+
+
+static
+bool in_main(const struct proc* p)
+{
+    return p->main;
+}
+
+
+static
+bool in_isr_only(const struct proc* p)
+{
+    return p->isr && !p->main;
+}
+
+
+// Overlay the locals of subroutines that can't be running at once, like a
+// compiled stack, and resolve the lines using them. Each frame goes above
+// the frames of every subroutine that can start it, so two frames share
+// bytes only if neither subroutine can be running while the other is. The
+// interrupt routine can run at any time, so everything it starts goes
+// above all of the main code. The frames go into the bank with the most
+// room left.
+static
+void place_locals(struct emr* const ctx, struct line* const rev,
+        struct gpr_space* const space, const struct local* const locals,
+        const size_t nlocal)
+{
+    struct line** lines;
+    int* label_idx;
+    size_t n = rev_line_array(ctx, rev, &lines, &label_idx);
+
+    bool* is_entry = arena_alloc(&ctx->arena, n * sizeof(bool));
+    size_t i;
+    for (i = 0; i < n; ++i)
+        is_entry[i] = false;
+    for (i = 0; i < nlocal; ++i) {
+        if (label_idx[locals[i].sub] < 0)
+            fatal(E_COMMON, "%u: Unknown subroutine label", locals[i].num);
+        is_entry[label_idx[locals[i].sub]] = true;
+    }
+
+    struct callgraph cg;
+    callgraph_build(ctx, &cg, lines, n, label_idx, is_entry);
+    if (cg.computed)
+        fatal(E_COMMON, "%u: Can't overlay locals when anything calls or "
+            "jumps to a computed address", locals[0].num);
+
+    size_t* size = arena_alloc(&ctx->arena, cg.nprocs * sizeof(size_t));
+    size_t* offset = arena_alloc(&ctx->arena, cg.nprocs * sizeof(size_t));
+    size_t* slot = arena_alloc(&ctx->arena, nlocal * sizeof(size_t));
+    for (size_t p = 0; p < cg.nprocs; ++p)
+        size[p] = offset[p] = 0;
+    for (i = 0; i < nlocal; ++i) {
+        const struct proc* proc =
+            &cg.procs[cg.proc_at[label_idx[locals[i].sub]]];
+        if (proc->main && proc->isr)
+            fatal(E_COMMON, "%u: Subroutine with locals can run in both "
+                "main code and the interrupt routine", locals[i].num);
+        slot[i] = size[cg.proc_at[label_idx[locals[i].sub]]]++;
+    }
+
+    size_t main_top = 0;
+    if (!raise_frames(&cg, size, offset, in_main))
+        fatal(E_COMMON, "%u: Recursion through a subroutine with locals",
+            locals[0].num);
+    for (size_t p = 0; p < cg.nprocs; ++p)
+        if (cg.procs[p].main)
+            main_top = max(main_top, offset[p] + size[p]);
+    for (size_t p = 0; p < cg.nprocs; ++p)
+        if (in_isr_only(&cg.procs[p]))
+            offset[p] = main_top;
+    if (!raise_frames(&cg, size, offset, in_isr_only))
+        fatal(E_COMMON, "%u: Recursion through a subroutine with locals",
+            locals[0].num);
+
+    // (Frames that can never run just start at the bottom.)
+    size_t total = 0;
+    for (size_t p = 0; p < cg.nprocs; ++p)
+        total = max(total, offset[p] + size[p]);
+
+    size_t best = 0;
+    int best_left = -1;
+    for (size_t b = 0; b < (size_t)(space->bankmax - space->bankmin + 1);
+            ++b) {
+        int end = (space->bankmin + (int)b == space->bankmax)
+            ? min(space->addrmax, 0x6F) : 0x6F;
+        int left = end + 1 - space->next[b];
+        if (left > best_left) {
+            best = b;
+            best_left = left;
+        }
+    }
+    if (best_left < (int)total)
+        fatal(E_COMMON, "%u: No GPR left for %zu bytes of locals",
+            locals[0].num, total);
+    int base = space->next[best];
+    space->next[best] += total;
+
+    for (i = 0; i < nlocal; ++i) {
+        struct reg* reg = &ctx->reg_array[locals[i].sym];
+        reg->bank = space->bankmin + best;
+        reg->addr = base + offset[cg.proc_at[label_idx[locals[i].sub]]]
+            + slot[i];
+    }
+
+    if (ctx->verbosity >= 2) {
+        for (i = 0; i < nlocal; ++i) {
+            const struct reg* reg = &ctx->reg_array[locals[i].sym];
+            fprintf(ctx->list, "%s: 0x%03X (%s)\n",
+                sym_name(&ctx->syms, locals[i].sym), reg->bank << 7 | reg->addr,
+                sym_name(&ctx->syms, locals[i].sub));
+        }
+    }
+    if (ctx->verbosity >= 1)
+        fprintf(ctx->list, "Locals: %zu bytes overlaid into %zu (%zu "
+            "saved)\n\n", nlocal, total, nlocal - total);
+
+    // Resolve the lines. (Only locals are left placed but unresolved.)
+    for (i = 0; i < n; ++i) {
+        struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+        int sym = line->opds[0].sym;
+
+        if (!(has_f(opc) || opc == C_MOVLB) || sym == SYM_NONE ||
+                ctx->reg_array[sym].bank < 0)
+            continue;
+        if (opc == C_MOVLB) {
+            line->opds[0].i = ctx->reg_array[sym].bank;
+        } else {
+            line->opds[0].i = ctx->reg_array[sym].addr;
+            line->bank = ctx->reg_array[sym].bank;
+        }
+        line->opds[0].sym = SYM_NONE;
+    }
+}
+
+
+//// A1 (forward) ////
+// .table : change to brw, named by its label
+// retlw, goto up to .endtable : count in the brw, star goto
+// .___ : process, remove
+// [*]___f___ : resolve, note bank
+static
+struct line* assemble_pass1(struct emr* const ctx, struct line* start,
+        int16_t* cfg)
+{
+    for (unsigned int i = 0; i < CPIC_CFG_LEN; ++i)
+        cfg[i] = -1;
+
+    struct gpr_space space = { .next = NULL };
+    int cautoaddr = 0x70;
+
+    struct auto_reg* autos = arena_alloc(&ctx->arena,
+        sym_count(&ctx->syms) * sizeof(struct auto_reg));
+    int* auto_idx = arena_alloc(&ctx->arena,
+        sym_count(&ctx->syms) * sizeof(int));
+    size_t nauto = 0;
+    struct local* locals = arena_alloc(&ctx->arena,
+        sym_count(&ctx->syms) * sizeof(struct local));
+    size_t nlocal = 0;
+
+    for (size_t i = 0; i < sym_count(&ctx->syms); ++i) {
+        ctx->label_array[i] = -1;
+        ctx->inline_array[i] = 0;
+        ctx->reg_array[i].bank = -1;
+        ctx->creg_array[i].addr = -1;
+    }
+
+    const struct insn* oi_brw = insn_lookup("brw", 3);
+    struct line* table = NULL; // (brw of the .table not ended yet)
+
+    int addr = 0;
+    struct line* prev = NULL;
+    struct line* line = start;
+    while (line != NULL) {
+        enum opcode opc = line->oi->opc;
+        line->bank = -1;
+
+        // Check table entries.
+        if (table != NULL && opc != CD_ENDTABLE) {
+            if (opc != C_RETLW && opc != C_GOTO)
+                fatal(E_COMMON, "%u: Expected retlw or goto in a table",
+                    line->num);
+            if (opc == C_GOTO)
+                line->star = true; // (The brw selects the page.)
+            ++table->opds[1].i;
+        }
+
+        // Handle directives.
+        if (opc == CD_TABLE) {
+            if (table != NULL)
+                fatal(E_COMMON, "%u: Table inside a table", line->num);
+            if (line->label != SYM_NONE)
+                fatal(E_COMMON, "%u: A table is labeled by its name",
+                    line->num);
+            table = line;
+            line->oi = oi_brw;
+            line->label = line->opds[0].sym;
+            line->opds[0].i = 0;
+            line->opds[0].sym = SYM_NONE;
+            line->opds[1].i = 0; // (Entries, counted as they come.)
+            line->opds[1].sym = SYM_NONE;
+            opc = C_BRW;
+        } else if (opc == CD_ENDTABLE) {
+            if (table == NULL)
+                fatal(E_COMMON, "%u: No table to end", line->num);
+            if (table->opds[1].i == 0)
+                fatal(E_COMMON, "%u: Table has no entries", line->num);
+            table = NULL;
+        } else if (opc == CD_GPR) {
+            space.bankmin = line->opds[0].i >> 7;
+            space.bankmax = line->opds[1].i >> 7;
+
+            space.next = arena_alloc(&ctx->arena,
+                (space.bankmax - space.bankmin + 1) * sizeof(int));
+            space.next[0] = line->opds[0].i & 0x7F;
+            for (int b = 1; b < space.bankmax - space.bankmin + 1; ++b)
+                space.next[b] = 0x20;
+            space.addrmax = line->opds[1].i & 0x7F;
+            space.common = 0;
+            for (int b = space.bankmin; b <= space.bankmax; ++b)
+                for (int k = 0; k < 0x10; ++k)
+                    if (line->opds[0].i <= (b << 7 | (0x70 + k)) &&
+                            (b << 7 | (0x70 + k)) <= line->opds[1].i)
+                        space.common |= 1u << k;
+        } else if (opc == CD_SFR) {
+            struct reg* reg = &ctx->reg_array[line->opds[1].sym];
+            if (reg->bank != -1)
+                fatal(E_COMMON, "%u: Register name already defined",
+                    line->num);
+            reg->bank = line->opds[0].i >> 7;
+            reg->addr = line->opds[0].i & 0x7F;
+        } else if (opc == CD_REG) {
+            if (space.next == NULL)
+                fatal(E_COMMON, "%u: No GPR range set", line->num);
+            int b = line->opds[0].i;
+            if (b >= 0 && !(space.bankmin <= b && b <= space.bankmax))
+                fatal(E_COMMON, "%u: Bank number %d out of range", line->num,
+                    b);
+            if (b >= 0 && gpr_full(&space, b))
+                fatal(E_COMMON, "%u: No GPR left in bank %d", line->num, b);
+
+            struct reg* reg = &ctx->reg_array[line->opds[1].sym];
+            if (reg->bank != -1)
+                fatal(E_COMMON, "%u: Register name already defined",
+                    line->num);
+            if (b < 0) {
+                reg->bank = REG_AUTO;
+                auto_idx[line->opds[1].sym] = nauto;
+                autos[nauto++] = (struct auto_reg){
+                    .sym = line->opds[1].sym, .num = line->num };
+            } else {
+                reg->bank = b;
+                reg->addr = space.next[b - space.bankmin]++;
+            }
+        } else if (opc == CD_LOCAL) {
+            if (space.next == NULL)
+                fatal(E_COMMON, "%u: No GPR range set", line->num);
+            struct reg* reg = &ctx->reg_array[line->opds[1].sym];
+            if (reg->bank != -1)
+                fatal(E_COMMON, "%u: Register name already defined",
+                    line->num);
+            reg->bank = REG_LOCAL;
+            locals[nlocal++] = (struct local){ .sym = line->opds[1].sym,
+                .sub = line->opds[0].sym, .num = line->num };
+        } else if (opc == CD_INLINE) {
+            ctx->inline_array[line->opds[0].sym] = line->num;
+        } else if (opc == CD_CREG) {
+            if (cautoaddr > 0x7F)
+                fatal(E_COMMON, "%u: No common registers left", line->num);
+            struct creg* creg = &ctx->creg_array[line->opds[0].sym];
+            if (find_creg(ctx, line->opds[0].sym) != NULL)
+                fatal(E_COMMON, "%u: Register name already defined",
+                    line->num);
+            creg->addr = cautoaddr++;
+            creg->name = sym_name(&ctx->syms, line->opds[0].sym);
+        } else if (opc == CD_CFG) {
+            int addr = line->opds[0].i - 0x8000;
+            if (addr < 0 || addr >= 0xF)
+                fatal(E_COMMON, "%u: Address out of range", line->num);
+            if (cfg[addr] >= 0)
+                fatal(E_COMMON, "%u: Configuration word already set",
+                    line->num);
+            cfg[addr] = line->opds[1].i;
+        }
+
+        // Store label info.
+        if (line->label != SYM_NONE) {
+            if (ctx->label_array[line->label] >= 0)
+                fatal(E_COMMON, "%u: Label already defined", line->num);
+            ctx->label_array[line->label] = addr;
+        }
+
+        // Resolve register names. Those without a bank yet are done once
+        // they're placed.
+        if (has_f(opc)) {
+            if (line->opds[0].sym != SYM_NONE) {
+                struct reg* reg = &ctx->reg_array[line->opds[0].sym];
+                if (reg->bank == REG_AUTO || reg->bank == REG_LOCAL) {
+                    // (Placed later.)
+                } else if (reg->bank < 0) {
+                    const struct creg* creg = find_creg(ctx, line->opds[0].sym);
+                    if (creg == NULL)
+                        fatal(E_COMMON, "%u: Unknown register name",
+                            line->num);
+                    line->opds[0].i = creg->addr;
+                    line->opds[0].sym = SYM_NONE;
+                } else {
+                    line->opds[0].i = reg->addr;
+                    line->opds[0].sym = SYM_NONE;
+                    line->bank = reg->bank;
+                }
+            } else {
+                line->opds[0].i &= 0x7F;
+            }
+        }
+
+        if (opc == C_MOVLB) {
+            if (line->opds[0].sym != SYM_NONE) {
+                struct reg* reg = &ctx->reg_array[line->opds[0].sym];
+                if (reg->bank == -1)
+                    fatal(E_COMMON, "%u: Unknown register name", line->num);
+                if (reg->bank != REG_AUTO && reg->bank != REG_LOCAL) {
+                    line->opds[0].i = reg->bank;
+                    line->opds[0].sym = SYM_NONE;
+                }
+            }
+        }
+
+        if (ctx->verbosity >= 2) {
+            fprintf(ctx->list, "[0x%04X] ", addr);
+            print_line(ctx, line);
+            fputc('\n', ctx->list);
+        }
+
+        // Increment address.
+        if ( !(C__LAST__ < opc && opc <= CD__LAST__) )
+            ++addr;
+
+        // Advance to next line.
+        {
+            struct line* old_next = line->next;
+            if ( !(C__LAST__ < opc && opc <= CD__LAST__) ) {
+                line->next = prev;
+                prev = line;
+            }
+            line = old_next;
+        }
+    }
+
+    if (ctx->verbosity >= 2)
+        fputc('\n', ctx->list);
+
+    if (table != NULL)
+        fatal(E_COMMON, "%u: Table not ended", table->num);
+
+    // (Checked here, before -O jumps can take out a subroutine nothing
+    // calls.)
+    for (size_t sym = 0; sym < sym_count(&ctx->syms); ++sym)
+        if (ctx->inline_array[sym] > 0 && ctx->label_array[sym] < 0)
+            fatal(E_COMMON, "%u: Unknown subroutine label",
+                ctx->inline_array[sym]);
+
+    ctx->gpr = space;
+    if (nlocal > 0)
+        place_locals(ctx, prev, &space, locals, nlocal);
+    if (nauto > 0)
+        place_regs(ctx, prev, &space, &cautoaddr, autos, nauto, auto_idx);
+
+    return prev;
+}
+
+
+// Put the lines pass 1 left in reverse back in order.
+static
+struct line* reverse_lines(struct line* start)
+{
+    struct line* prev = NULL;
+    while (start != NULL) {
+        struct line* next = start->next;
+        start->next = prev;
+        prev = start;
+        start = next;
+    }
+    return prev;
+}
+
+
+// Mark the lines that are reached through a computed jump without a label
+// of their own: the table after a brw or a write to PCL, which ends with
+// the first line that doesn't jump away itself. None of them can move.
+static
+void mark_tables(struct line** const lines, const size_t n,
+        bool* const table)
+{
+    for (size_t i = 0; i < n; ++i)
+        table[i] = false;
+    for (size_t i = 0; i < n; ++i) {
+        if (lines[i]->oi->opc != C_BRW && !writes_creg(lines[i], 0x02))
+            continue;
+        for (size_t j = i + 1; j < n; ++j) {
+            table[j] = true;
+            if (falls_through(lines[j]->oi->opc))
+                break;
+        }
+    }
+}
+
+
+// Give the label of a line that's going away to the line after it, or if
+// that has a label already, point everything at that one instead. A label
+// nothing uses is just dropped.
+static
+void pass_label(struct line** const lines, const size_t n,
+        const bool* const dead, struct line* from, struct line* to)
+{
+    int label = from->label;
+    from->label = SYM_NONE;
+    if (label == SYM_NONE)
+        return;
+
+    bool used = false;
+    for (size_t i = 0; i < n && !used; ++i)
+        used = !dead[i] && lines[i]->oi->opds[0] == L &&
+            lines[i]->opds[0].sym == label;
+    if (!used || to == NULL)
+        return; // (Nothing left can be using it, in the second case.)
+    if (to->label == SYM_NONE) {
+        to->label = label;
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        if (lines[i]->oi->opds[0] == L && lines[i]->opds[0].sym == label)
+            lines[i]->opds[0].sym = to->label;
+}
+
+
+// Link up the lines that aren't dead, passing on the labels of those that
+// are. Returns the new first line.
+static
+struct line* drop_dead(struct line** const lines, const size_t n,
+        const bool* const dead)
+{
+    struct line* start = NULL;
+    struct line* prev = NULL;
+    struct line* keep = NULL; // (next line kept, going backward)
+    for (size_t i = n; i-- > 0; /* */) {
+        if (dead[i])
+            pass_label(lines, n, dead, lines[i], keep);
+        else
+            keep = lines[i];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (dead[i])
+            continue;
+        if (prev != NULL)
+            prev->next = lines[i];
+        else
+            start = lines[i];
+        prev = lines[i];
+    }
+    if (prev != NULL)
+        prev->next = NULL;
+    return start;
+}
+
+
+// Whether two lines assemble the same way.
+static inline
+bool same_line(const struct line* a, const struct line* b)
+{
+    return a->oi == b->oi && a->star == b->star && a->bank == b->bank &&
+        a->opds[0].i == b->opds[0].i && a->opds[0].sym == b->opds[0].sym &&
+        a->opds[1].i == b->opds[1].i && a->opds[1].sym == b->opds[1].sym;
+}
+
+
+// Whether the lines from i on can be removed without anything falling
+// into them.
+static inline
+bool fallen_into(struct line** const lines, const size_t i)
+{
+    return i == 0 || falls_through(lines[i - 1]->oi->opc) ||
+        (i > 1 && is_skip(lines[i - 2]->oi->opc));
+}
+
+
+//// Tables (forward) ////
+// brw of a .table the same as one before : remove, use the one before
+//
+// A table is only removed if nothing falls or skips into it, and the same
+// goes for a table with a label on one of its entries.
+static
+struct line* merge_tables(struct emr* const ctx, struct line* start)
+{
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+    bool* dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+    size_t i;
+    for (i = 0; i < n; ++i)
+        dead[i] = false;
+
+    bool changed = false;
+    for (i = 0; i < n; ++i) {
+        const int entries = lines[i]->opds[1].i;
+        if (lines[i]->oi->opc != C_BRW || entries == 0 ||
+                lines[i]->label == SYM_NONE || fallen_into(lines, i))
+            continue;
+        for (size_t k = 0; k < i; ++k) {
+            if (lines[k]->oi->opc != C_BRW || lines[k]->opds[1].i != entries
+                    || lines[k]->label == SYM_NONE || dead[k])
+                continue;
+            int j;
+            for (j = 1; j <= entries; ++j)
+                if (!same_line(lines[k + j], lines[i + j]) ||
+                        lines[i + j]->label != SYM_NONE)
+                    break;
+            if (j <= entries)
+                continue;
+
+            int dup = lines[i]->label;
+            for (size_t r = 0; r < n; ++r)
+                if (lines[r]->oi->opds[0] == L && lines[r]->opds[0].sym == dup)
+                    lines[r]->opds[0].sym = lines[k]->label;
+            for (j = 0; j <= entries; ++j)
+                dead[i + j] = true;
+            if (ctx->verbosity >= 1)
+                fprintf(ctx->list, "Table %s: Same as %s\n",
+                    sym_name(&ctx->syms, dup),
+                    sym_name(&ctx->syms, lines[k]->label));
+            changed = true;
+            break;
+        }
+    }
+    if (!changed)
+        return start;
+
+    if (ctx->verbosity >= 1)
+        fputc('\n', ctx->list);
+    return drop_dead(lines, n, dead);
+}
+
+
+// A basic block: lines first to last, only ever entered at first and only
+// ever left after last.
+struct block {
+    size_t first;
+    size_t last;
+    bool reached;
+};
+
+
+// Where a chain of goto and bra starting at line t ends up.
+static
+size_t jump_dest(struct line** const lines, const size_t n,
+        const int* const label_idx, size_t t)
+{
+    for (size_t steps = 0; steps < n; ++steps) {
+        const struct line* line = lines[t];
+        enum opcode opc = line->oi->opc;
+        if ((opc != C_GOTO && opc != C_BRA) || line->opds[0].sym == SYM_NONE
+                || label_idx[line->opds[0].sym] < 0)
+            break;
+        t = label_idx[line->opds[0].sym];
+    }
+    return t; // (Somewhere in a loop of jumps, if it is one.)
+}
+
+
+// Split the lines into basic blocks and find those that can be reached
+// from reset or the interrupt vector. If anything jumps to a computed
+// address, so can every label, and so can every label whose address is
+// taken, along with the lines after it up to the next label (which are
+// likely a table read through FSR). Returns how many blocks there are.
+static
+size_t build_cfg(struct emr* const ctx, struct line** const lines,
+        const size_t n, const int* const label_idx, struct block** blocks,
+        size_t** block_of)
+{
+    bool computed = false;
+    bool* taken = arena_alloc(&ctx->arena, n * sizeof(bool));
+    bool* leader = arena_alloc(&ctx->arena, (n + 1) * sizeof(bool));
+    size_t isr = vector_line(lines, n);
+    size_t i;
+    for (i = 0; i <= n; ++i)
+        leader[i] = (i == 0 || i == n || i == isr ||
+            lines[i]->label != SYM_NONE);
+    for (i = 0; i < n; ++i) {
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+
+        taken[i] = false;
+        if (opc == C_CALLW || writes_creg(line, 0x02))
+            computed = true;
+        if ((opc == C_BRA || opc == C_GOTO || opc == C_CALL) &&
+                line->opds[0].sym == SYM_NONE)
+            computed = true;
+        if (!falls_through(opc) || opc == C_CALL || opc == C_CALLW ||
+                is_skip(opc))
+            leader[i + 1] = true;
+        if (is_skip(opc) && i + 2 < n)
+            leader[i + 2] = true;
+    }
+    for (i = 0; i < n; ++i) {
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+        if ((opc == C_MOVLP || opc == C_MOVPLW || opc == C_MOVPHW) &&
+                line->opds[0].sym != SYM_NONE &&
+                label_idx[line->opds[0].sym] >= 0) {
+            size_t j = label_idx[line->opds[0].sym];
+            do {
+                taken[j++] = true;
+            } while (j < n && lines[j]->label == SYM_NONE);
+        }
+    }
+
+    *blocks = arena_alloc(&ctx->arena, n * sizeof(struct block));
+    *block_of = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    size_t nblocks = 0;
+    for (i = 0; i < n; ++i) {
+        if (leader[i])
+            (*blocks)[nblocks++] = (struct block){ .first = i };
+        (*blocks)[nblocks - 1].last = i;
+        (*block_of)[i] = nblocks - 1;
+    }
+
+    size_t* work = arena_alloc(&ctx->arena, nblocks * sizeof(size_t));
+    size_t top = 0;
+    for (size_t b = 0; b < nblocks; ++b) {
+        size_t first = (*blocks)[b].first;
+        if (first == 0 || first == isr || taken[first] ||
+                (computed && lines[first]->label != SYM_NONE)) {
+            (*blocks)[b].reached = true;
+            work[top++] = b;
+        }
+    }
+
+    while (top > 0) {
+        const struct block* block = &(*blocks)[work[--top]];
+
+        // (Calls come back, so a call only adds its target.)
+        for (i = block->first; i <= block->last; ++i) {
+            const struct line* line = lines[i];
+            enum opcode opc = line->oi->opc;
+            size_t next[3];
+            size_t nnext = 0;
+
+            if (i == block->last && falls_through(opc) && i + 1 < n)
+                next[nnext++] = i + 1;
+            if (is_skip(opc) && i + 2 < n)
+                next[nnext++] = i + 2;
+            if ((opc == C_BRA || opc == C_GOTO || opc == C_CALL) &&
+                    line->opds[0].sym != SYM_NONE &&
+                    label_idx[line->opds[0].sym] >= 0)
+                next[nnext++] = label_idx[line->opds[0].sym];
+            size_t table_end = i;
+            if (opc == C_BRW)
+                while (table_end + 1 < n &&
+                        (table_end == i ||
+                        !falls_through(lines[table_end]->oi->opc)))
+                    ++table_end;
+
+            for (size_t k = 0; k < nnext + (table_end - i); ++k) {
+                size_t j = (k < nnext) ? next[k] : i + 1 + (k - nnext);
+                struct block* to = &(*blocks)[(*block_of)[j]];
+                if (!to->reached) {
+                    to->reached = true;
+                    work[top++] = (*block_of)[j];
+                }
+            }
+        }
+    }
+
+    return nblocks;
+}
+
+
+//// Jumps (forward, optional) ////
+// goto, bra, call to a goto or bra : retarget to where that ends up
+// goto, bra to a return, retlw or retfie : replace with a copy of it
+// goto, bra to the next line : remove
+// block that can't be reached : remove
+//
+// This runs over the basic blocks of the lines as pass 1 leaves them, so
+// the layout that follows sees the final targets. Nothing is taken out
+// right after a skip, in a table after brw or a write to PCL, or up to the
+// interrupt vector, nothing before the vector becomes a return (which would
+// move the vector), and starred lines are neither retargeted nor removed
+// as jumps to the next line.
+static
+struct line* opt_jumps(struct emr* const ctx, struct line* start)
+{
+    unsigned int threaded = 0;
+    unsigned int saved = 0;
+
+    for (unsigned int round = 0; round < 8; ++round) {
+        struct line** lines;
+        int* label_idx;
+        size_t n = line_array(ctx, start, &lines, &label_idx);
+        bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        bool* dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+        mark_tables(lines, n, table);
+        size_t isr = vector_line(lines, n);
+
+        // Thread the jumps.
+        bool changed = false;
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            struct line* line = lines[i];
+            enum opcode opc = line->oi->opc;
+            int sym = line->opds[0].sym;
+            if ((opc != C_GOTO && opc != C_BRA && opc != C_CALL) ||
+                    line->star || sym == SYM_NONE || label_idx[sym] < 0)
+                continue;
+
+            size_t t = label_idx[sym];
+            size_t d = jump_dest(lines, n, label_idx, t);
+            enum opcode opc_d = lines[d]->oi->opc;
+            if (opc != C_CALL && (opc_d == C_RETURN || opc_d == C_RETLW ||
+                    opc_d == C_RETFIE) && !(isr != SIZE_MAX && i < isr)) {
+                line->oi = lines[d]->oi;
+                line->opds[0] = lines[d]->opds[0];
+            } else if (d != t) {
+                line->opds[0].sym = lines[d]->label;
+            } else {
+                continue;
+            }
+            ++threaded;
+            changed = true;
+        }
+
+        // Drop what can't be reached, and jumps to the next line.
+        struct block* blocks;
+        size_t* block_of;
+        build_cfg(ctx, lines, n, label_idx, &blocks, &block_of);
+        for (i = 0; i < n; ++i) {
+            const struct line* line = lines[i];
+            enum opcode opc = line->oi->opc;
+            int sym = line->opds[0].sym;
+
+            dead[i] = false;
+            if (isr != SIZE_MAX && i <= isr)
+                continue;
+            if (!blocks[block_of[i]].reached) {
+                dead[i] = true;
+            } else if ((opc == C_GOTO || opc == C_BRA) && !line->star &&
+                    sym != SYM_NONE && label_idx[sym] == (int)i + 1 &&
+                    !table[i] && !(i > 0 && is_skip(lines[i - 1]->oi->opc))) {
+                dead[i] = true;
+            }
+            if (dead[i]) {
+                ++saved;
+                changed = true;
+            }
+        }
+
+        if (!changed)
+            break;
+        start = drop_dead(lines, n, dead);
+    }
+
+    if (ctx->verbosity >= 1)
+        fprintf(ctx->list, "Jumps: %u retargeted, %u words saved\n\n",
+            threaded, saved);
+
+    return start;
+}
+
+
+// Most hardware stack levels the program can use, counting one for the
+// interrupt and whatever the interrupt routine calls, or -1 if that isn't
+// bounded or can't be told.
+static
+int stack_depth(struct emr* const ctx, struct line** const lines,
+        const size_t n, const int* const label_idx)
+{
+    struct callgraph cg;
+    callgraph_build(ctx, &cg, lines, n, label_idx, NULL);
+    if (cg.computed || cg.main == SIZE_MAX)
+        return -1;
+
+    int* depth = arena_alloc(&ctx->arena, cg.nprocs * sizeof(int));
+    for (size_t p = 0; p < cg.nprocs; ++p)
+        depth[p] = 0;
+    for (size_t round = 0; /* */; ++round) {
+        bool changed = false;
+        for (size_t e = 0; e < cg.nedges; ++e) {
+            const struct call_edge* edge = &cg.edges[e];
+            int d = depth[edge->from] + (edge->call ? 1 : 0);
+            if (d > depth[edge->to]) {
+                depth[edge->to] = d;
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+        if (round == cg.nprocs)
+            return -1; // (Recursion.)
+    }
+
+    int main_depth = 0;
+    int isr_depth = -1;
+    for (size_t p = 0; p < cg.nprocs; ++p) {
+        if (cg.procs[p].main)
+            main_depth = max(main_depth, depth[p]);
+        if (cg.procs[p].isr)
+            isr_depth = max(isr_depth, depth[p]);
+    }
+    // (The interrupt routine starts out one level down itself.)
+    if (cg.isr != SIZE_MAX)
+        main_depth += 1 + isr_depth - depth[cg.isr];
+    return main_depth;
+}
+
+
+static
+void print_depth(struct emr* const ctx, int depth)
+{
+    if (depth < 0)
+        fputs("unknown", ctx->list);
+    else
+        fprintf(ctx->list, "%d", depth);
+}
+
+
+// Subroutines longer than this (not counting the return) aren't inlined.
+#define INLINE_MAX_LINES 8
+
+
+// If the subroutine at line t can be inlined, return the index of its
+// return. It has to be straight-line code ending in a return, with no
+// label after the first line and no starred lines.
+static
+size_t inline_body(struct line** const lines, const size_t n, size_t t)
+{
+    for (size_t i = t; i < n && i <= t + INLINE_MAX_LINES; ++i) {
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+
+        if ((i > t && line->label != SYM_NONE) || line->star)
+            return SIZE_MAX;
+        if (opc == C_RETURN)
+            return (i > t && is_skip(lines[i - 1]->oi->opc)) ? SIZE_MAX : i;
+        if (!falls_through(opc) || opc == C_CALLW ||
+                writes_creg(line, 0x02) || (opc == C_CALL &&
+                line->opds[0].sym == lines[t]->label))
+            return SIZE_MAX;
+    }
+    return SIZE_MAX;
+}
+
+
+//// Inline (forward, optional) ////
+// call to a short subroutine with one call site or marked with .inline :
+//     replace with a copy of the subroutine
+// call then return : goto
+//
+// A subroutine can be inlined if it's straight-line code ending in its
+// first return. One with a single call site is only inlined if it can
+// then be removed, which needs nothing else using its label and nothing
+// falling into it. A call after a skip is only inlined if that leaves one
+// line, and a return after a skip is kept. Nothing up to the interrupt
+// vector or in a table after brw or a write to PCL is moved, and starred
+// lines are left alone.
+static
+struct line* opt_inline(struct emr* const ctx, struct line* start)
+{
+    const struct insn* oi_goto = insn_lookup("goto", 4);
+    unsigned int inlined = 0;
+    unsigned int tail = 0;
+
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+    const int depth_before = stack_depth(ctx, lines, n, label_idx);
+    const size_t len_before = n;
+    for (unsigned int round = 0; round < 4; ++round) {
+        if (round > 0)
+            n = line_array(ctx, start, &lines, &label_idx);
+
+        bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        bool* dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+        bool* in_body = arena_alloc(&ctx->arena, n * sizeof(bool));
+        size_t* body = arena_alloc(&ctx->arena, n * sizeof(size_t));
+        size_t* uses = arena_alloc(&ctx->arena, n * sizeof(size_t));
+        size_t* calls = arena_alloc(&ctx->arena, n * sizeof(size_t));
+        struct line** copies = arena_alloc(&ctx->arena,
+            n * sizeof(struct line*));
+        mark_tables(lines, n, table);
+        size_t isr = vector_line(lines, n);
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            dead[i] = in_body[i] = false;
+            body[i] = SIZE_MAX;
+            uses[i] = calls[i] = 0;
+            copies[i] = NULL;
+        }
+
+        // Count what uses each label, and pick the subroutines to inline.
+        for (i = 0; i < n; ++i) {
+            const struct line* line = lines[i];
+            int sym = line->opds[0].sym;
+            if (line->oi->opds[0] != L || sym == SYM_NONE ||
+                    label_idx[sym] < 0)
+                continue;
+            ++uses[label_idx[sym]];
+            if (line->oi->opc == C_CALL)
+                ++calls[label_idx[sym]];
+        }
+        for (i = 0; i < n; ++i) {
+            if (calls[i] == 0 || table[i] || (isr != SIZE_MAX && i <= isr))
+                continue;
+            if (ctx->inline_array[lines[i]->label] == 0 && (calls[i] != 1 ||
+                    uses[i] != 1 || fallen_into(lines, i)))
+                continue;
+            body[i] = inline_body(lines, n, i);
+            if (body[i] == SIZE_MAX)
+                continue;
+            for (size_t j = i; j <= body[i]; ++j)
+                in_body[j] = true;
+        }
+
+        // Copy the subroutines in place of the calls. The first line of the
+        // copy goes over the call, and the rest are put after it once the
+        // lines are linked up again.
+        bool changed = false;
+        for (i = 0; i < n; ++i) {
+            struct line* line = lines[i];
+            int sym = line->opds[0].sym;
+            bool after_skip = (i > 0 && is_skip(lines[i - 1]->oi->opc));
+
+            if (line->oi->opc != C_CALL || line->star || sym == SYM_NONE ||
+                    label_idx[sym] < 0 || in_body[i] || table[i] ||
+                    (isr != SIZE_MAX && i <= isr))
+                continue;
+            size_t t = label_idx[sym];
+            if (body[t] == SIZE_MAX || (after_skip && body[t] - t != 1))
+                continue;
+
+            --uses[t];
+            ++inlined;
+            changed = true;
+            if (body[t] == t) {
+                dead[i] = true; // (Nothing to put in its place.)
+                line->opds[0].sym = SYM_NONE;
+                continue;
+            }
+
+            int label = line->label;
+            *line = *lines[t];
+            line->label = label;
+            struct line* last = NULL;
+            for (size_t j = body[t]; j-- > t + 1; /* */) {
+                struct line* new = arena_alloc(&ctx->arena,
+                    sizeof(struct line));
+                *new = *lines[j];
+                new->label = SYM_NONE;
+                new->next = copies[i];
+                copies[i] = new;
+                if (last == NULL)
+                    last = new;
+            }
+            if (last != NULL)
+                last->next = line; // (Where the rest go, for now.)
+        }
+
+        // Drop what's left of the subroutines nobody calls now.
+        for (i = 0; i < n; ++i) {
+            if (body[i] == SIZE_MAX || uses[i] > 0 || fallen_into(lines, i))
+                continue;
+            for (size_t j = i; j <= body[i]; ++j)
+                dead[j] = true;
+        }
+        start = drop_dead(lines, n, dead);
+        for (i = 0; i < n; ++i) {
+            if (copies[i] == NULL)
+                continue;
+            struct line* last = copies[i];
+            while (last->next != lines[i])
+                last = last->next;
+            last->next = lines[i]->next;
+            lines[i]->next = copies[i];
+        }
+
+        // Turn calls followed by a return into jumps.
+        n = line_array(ctx, start, &lines, &label_idx);
+        table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+        mark_tables(lines, n, table);
+        isr = vector_line(lines, n);
+        for (i = 0; i < n; ++i)
+            dead[i] = false;
+        for (i = 0; i + 1 < n; ++i) {
+            struct line* line = lines[i];
+            const struct line* next = lines[i + 1];
+            if (line->oi->opc != C_CALL || line->star || table[i] ||
+                    next->oi->opc != C_RETURN || next->star)
+                continue;
+            line->oi = oi_goto;
+            ++tail;
+            changed = true;
+            dead[i + 1] = (next->label == SYM_NONE &&
+                !(i > 0 && is_skip(lines[i - 1]->oi->opc)) &&
+                !(isr != SIZE_MAX && i + 1 <= isr));
+        }
+        start = drop_dead(lines, n, dead);
+
+        if (!changed)
+            break;
+    }
+
+    if (ctx->verbosity >= 1) {
+        n = line_array(ctx, start, &lines, &label_idx);
+        fprintf(ctx->list, "Inline: %u calls inlined, %u tail calls, %d "
+            "words saved, stack depth ", inlined, tail,
+            (int)len_before - (int)n);
+        print_depth(ctx, depth_before);
+        fputs(" before, ", ctx->list);
+        print_depth(ctx, stack_depth(ctx, lines, n, label_idx));
+        fputs(" after\n\n", ctx->list);
+    }
+
+    return start;
+}
+
+
+// What the peephole optimizer follows: W, and the STATUS bits that results
+// set (numbered as in STATUS).
+#define PV_C 0x01
+#define PV_DC 0x02
+#define PV_Z 0x04
+#define PV_W 0x08
+#define PV_FLAGS (PV_C | PV_DC | PV_Z)
+#define PV_ALL (PV_FLAGS | PV_W)
+
+
+// STATUS bits an instruction always sets from its result.
+static inline
+unsigned int flags_set(enum opcode opc)
+{
+    switch (opc) {
+        case C_ADDWF: case C_ADDWFC: case C_SUBWF: case C_SUBWFB:
+        case C_ADDLW: case C_SUBLW:
+            return PV_C | PV_DC | PV_Z;
+        case C_ANDWF: case C_IORWF: case C_XORWF: case C_COMF: case C_DECF:
+        case C_INCF: case C_MOVF: case C_CLRF: case C_CLRW: case C_ANDLW:
+        case C_IORLW: case C_XORLW: case C_MOVIW:
+            return PV_Z;
+        case C_ASRF: case C_LSLF: case C_LSRF:
+            return PV_C | PV_Z;
+        case C_RLF: case C_RRF:
+            return PV_C;
+        default:
+            return 0;
+    }
+}
+
+
+static inline
+bool reads_w(enum opcode opc)
+{
+    switch (opc) {
+        case C_ADDWF: case C_ADDWFC: case C_ANDWF: case C_IORWF:
+        case C_SUBWF: case C_SUBWFB: case C_XORWF: case C_MOVWF:
+        case C_ADDLW: case C_ANDLW: case C_IORLW: case C_SUBLW:
+        case C_XORLW: case C_BRW: case C_CALLW: case C_MOVWI: case C_TRIS:
+        case C_OPTION:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// Whether the result goes to W rather than to the register.
+static inline
+bool to_w(const struct line* line)
+{
+    enum opcode opc = line->oi->opc;
+    if (line->oi->opds[1] == D)
+        return line->opds[1].i == 0;
+    return opc == C_CLRW || opc == C_MOVIW || opc == C_MOVPLW ||
+        opc == C_MOVPHW || (C_ADDLW <= opc && opc <= C_XORLW &&
+        opc != C_MOVLB && opc != C_MOVLP);
+}
+
+
+// Whether the line writes its register operand.
+static inline
+bool writes_f(const struct line* line)
+{
+    enum opcode opc = line->oi->opc;
+    return opc == C_CLRF || opc == C_MOVWF || opc == C_BCF ||
+        opc == C_BSF || (line->oi->opds[1] == D && line->opds[1].i == 1);
+}
+
+
+// Key for a register operand that's plain memory: GPR in a known bank, or
+// common RAM. Anything else (SFRs, or GPR in whatever bank is selected)
+// gets -1 and is never assumed to hold what was written to it.
+static inline
+int gpr_key(const struct emr* const ctx, const struct line* line)
+{
+    int addr = line->opds[0].i;
+    if (!has_f(line->oi->opc) || line->opds[0].sym != SYM_NONE)
+        return -1;
+    if (0x70 <= addr && addr <= 0x7F)
+        return addr;
+    if (0x20 <= addr && addr <= 0x6F && ctx->gpr.next != NULL &&
+            ctx->gpr.bankmin <= line->bank && line->bank <= ctx->gpr.bankmax)
+        return line->bank << 7 | addr;
+    return -1;
+}
+
+
+// Whether a write to the line's register could change GPR some other line
+// sees under a different name.
+static inline
+bool may_alias(const struct emr* const ctx, const struct line* line)
+{
+    enum opcode opc = line->oi->opc;
+    if (opc == C_MOVWI)
+        return true;
+    if (!has_f(opc) || !writes_f(line) || gpr_key(ctx, line) >= 0)
+        return false;
+    int addr = line->opds[0].i;
+    return addr <= 0x01 || addr >= 0x20;
+}
+
+
+// Registers the interrupt routine might write, by gpr_key(), found by
+// following everything reached from the vector, calls included. If it
+// writes through FSR or a register without a key, or jumps somewhere that
+// can't be followed, it's taken to write them all. NULL without one.
+static
+bool* isr_writes(struct emr* const ctx, struct line** const lines,
+        const size_t n, const int* const label_idx, const size_t isr)
+{
+    if (isr == SIZE_MAX)
+        return NULL;
+    const size_t nkeys = 32 << 7;
+    bool* writes = arena_alloc(&ctx->arena, nkeys * sizeof(bool));
+    bool* seen = arena_alloc(&ctx->arena, n * sizeof(bool));
+    size_t* work = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    size_t i;
+    for (i = 0; i < nkeys; ++i)
+        writes[i] = false;
+    for (i = 0; i < n; ++i)
+        seen[i] = false;
+
+    bool all = false;
+    size_t top = 0;
+    work[top++] = isr;
+    seen[isr] = true;
+    while (top > 0 && !all) {
+        i = work[--top];
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+        int sym = line->opds[0].sym;
+
+        if (may_alias(ctx, line) || opc == C_CALLW ||
+                writes_creg(line, 0x02))
+            all = true;
+        if (has_f(opc) && writes_f(line) && gpr_key(ctx, line) >= 0)
+            writes[gpr_key(ctx, line)] = true;
+
+        size_t next[3];
+        size_t nnext = 0;
+        if (falls_through(opc) && i + 1 < n)
+            next[nnext++] = i + 1;
+        if (is_skip(opc) && i + 2 < n)
+            next[nnext++] = i + 2;
+        if (opc == C_BRA || opc == C_GOTO || opc == C_CALL) {
+            if (sym == SYM_NONE || label_idx[sym] < 0)
+                all = true;
+            else
+                next[nnext++] = label_idx[sym];
+        }
+        size_t table_end = i;
+        if (opc == C_BRW)
+            while (table_end + 1 < n &&
+                    (table_end == i ||
+                    !falls_through(lines[table_end]->oi->opc)))
+                ++table_end;
+
+        for (size_t k = 0; k < nnext + (table_end - i); ++k) {
+            size_t j = (k < nnext) ? next[k] : i + 1 + (k - nnext);
+            if (!seen[j]) {
+                seen[j] = true;
+                work[top++] = j;
+            }
+        }
+    }
+    if (all)
+        for (i = 0; i < nkeys; ++i)
+            writes[i] = true;
+    return writes;
+}
+
+
+// Whether the line reads its register operand.
+static inline
+bool reads_f(const struct line* line)
+{
+    enum opcode opc = line->oi->opc;
+    return has_f(opc) && opc != C_MOVWF && opc != C_CLRF;
+}
+
+
+// W and STATUS bits a line reads (use) and always writes (def).
+static
+void line_uses(const struct line* line, unsigned int* use, unsigned int* def)
+{
+    enum opcode opc = line->oi->opc;
+    *use = reads_w(opc) ? PV_W : 0;
+    *def = flags_set(opc) | (to_w(line) ? PV_W : 0);
+
+    if (opc == C_ADDWFC || opc == C_SUBWFB || opc == C_RLF || opc == C_RRF)
+        *use |= PV_C;
+    if (opc == C_CALL || opc == C_CALLW || opc == C_RESET || opc == C_SLEEP)
+        *use = PV_ALL;
+
+    // Reading STATUS or WREG, or whatever FSR points at, which might be
+    // either.
+    int addr = line->opds[0].i;
+    if (opc == C_MOVIW || (reads_f(line) && addr <= 0x01))
+        *use |= PV_ALL;
+    if (reads_f(line) && addr == 0x09)
+        *use |= PV_W;
+    if (has_f(opc) && addr == 0x03) {
+        unsigned int bit = (1u << line->opds[1].i) & PV_FLAGS;
+        if (opc == C_BCF || opc == C_BSF)
+            *def |= bit;
+        else if (opc == C_BTFSC || opc == C_BTFSS)
+            *use |= bit;
+        else if (reads_f(line))
+            *use |= PV_FLAGS;
+    }
+}
+
+
+// What's known going into a line.
+struct wstate {
+    int w; // (value of W, or -1)
+    int w_reg; // (gpr_key of a register W is a copy of, or -1)
+    unsigned int known; // (PV_ flags whose values are known)
+    unsigned int flags; // (their values)
+};
+
+
+static const struct wstate wstate_unknown = { .w = -1, .w_reg = -1 };
+
+
+static inline
+struct wstate wstate_meet(struct wstate a, struct wstate b)
+{
+    struct wstate s = wstate_unknown;
+    if (a.w == b.w)
+        s.w = a.w;
+    if (a.w_reg == b.w_reg)
+        s.w_reg = a.w_reg;
+    s.known = a.known & b.known & ~(a.flags ^ b.flags);
+    s.flags = a.flags & s.known;
+    return s;
+}
+
+
+// State after the line, given the state before it.
+static
+struct wstate wstate_step(const struct emr* const ctx, const struct line* line,
+        struct wstate s)
+{
+    enum opcode opc = line->oi->opc;
+    if (opc == C_CALL || opc == C_CALLW)
+        return wstate_unknown;
+
+    const int key = gpr_key(ctx, line);
+    const int addr = line->opds[0].i;
+    unsigned int use, def;
+    line_uses(line, &use, &def);
+
+    // Work out literal operations on a known W.
+    const int k = line->opds[0].i;
+    int w = -1;
+    unsigned int carry = 0; // (C and DC, for addlw and sublw)
+    if (opc == C_MOVLW) {
+        w = k;
+    } else if (opc == C_CLRW) {
+        w = 0;
+    } else if (s.w >= 0 && (opc == C_ANDLW || opc == C_IORLW ||
+            opc == C_XORLW)) {
+        w = (opc == C_ANDLW) ? (s.w & k) : (opc == C_IORLW) ? (s.w | k)
+            : (s.w ^ k);
+    } else if (s.w >= 0 && (opc == C_ADDLW || opc == C_SUBLW)) {
+        // (For sublw, C and DC mean no borrow.)
+        int r = (opc == C_ADDLW) ? s.w + k : k - s.w;
+        int rl = (opc == C_ADDLW) ? (s.w & 0xF) + (k & 0xF)
+            : (k & 0xF) - (s.w & 0xF);
+        w = r & 0xFF;
+        if ((opc == C_ADDLW) ? r > 0xFF : r >= 0)
+            carry |= PV_C;
+        if ((opc == C_ADDLW) ? rl > 0xF : rl >= 0)
+            carry |= PV_DC;
+    }
+
+    // STATUS. Writes to it other than bcf and bsf aren't followed.
+    unsigned int set = flags_set(opc);
+    bool indirect = (opc == C_MOVWI ||
+        (writes_f(line) && (addr <= 0x01 || addr == 0x09)));
+    if (indirect || (writes_f(line) && addr == 0x03 && opc != C_BCF &&
+            opc != C_BSF))
+        set |= PV_FLAGS;
+    s.known &= ~set;
+    s.flags &= s.known;
+    if (has_f(opc) && addr == 0x03 && (opc == C_BCF || opc == C_BSF)) {
+        unsigned int bit = (1u << line->opds[1].i) & PV_FLAGS;
+        s.known |= bit;
+        if (opc == C_BSF)
+            s.flags |= bit;
+    }
+    if (opc == C_CLRF && addr != 0x03) {
+        s.known |= PV_Z;
+        s.flags |= PV_Z;
+    }
+
+    // W.
+    if (def & PV_W) {
+        if (opc == C_MOVF && key >= 0 && key == s.w_reg) {
+            // (W already has it.)
+        } else {
+            s.w = w;
+            s.w_reg = (opc == C_MOVF) ? key : -1;
+        }
+        if (s.w >= 0 && (set & PV_Z)) {
+            s.known |= PV_Z;
+            s.flags = (s.flags & ~PV_Z) | ((s.w == 0) ? PV_Z : 0);
+        }
+        if (w >= 0 && (opc == C_ADDLW || opc == C_SUBLW)) {
+            s.known |= PV_C | PV_DC;
+            s.flags = (s.flags & ~(PV_C | PV_DC)) | carry;
+        }
+    }
+    if (indirect) {
+        s.w = -1;
+        s.w_reg = -1;
+    }
+
+    // Registers.
+    if (opc == C_MOVWF && key >= 0)
+        s.w_reg = key;
+    else if (writes_f(line) && key >= 0 && key == s.w_reg)
+        s.w_reg = -1;
+    if (may_alias(ctx, line))
+        s.w_reg = -1;
+
+    return s;
+}
+
+
+// W and STATUS bits that might be read after line i, given what might be
+// read going into each line after it. Everything might be read after a
+// jump, a call or a return, or going into a label.
+static inline
+unsigned int live_after(struct line** const lines, const size_t n,
+        const unsigned int* const live, size_t i)
+{
+    enum opcode opc = lines[i]->oi->opc;
+    unsigned int out;
+    if (!falls_through(opc) || opc == C_CALL || opc == C_CALLW ||
+            i + 1 >= n || lines[i + 1]->label != SYM_NONE)
+        out = PV_ALL;
+    else
+        out = live[i + 1];
+    if (is_skip(opc))
+        out |= (i + 2 < n) ? live[i + 2] : PV_ALL;
+    return out;
+}
+
+
+// Whether the line does nothing but set W and STATUS bits.
+static inline
+bool only_sets_w(const struct emr* const ctx, const struct line* line)
+{
+    enum opcode opc = line->oi->opc;
+    if (has_f(opc))
+        return to_w(line) && !is_skip(opc) && gpr_key(ctx, line) >= 0;
+    return opc == C_CLRW || opc == C_MOVPLW || opc == C_MOVPHW ||
+        (C_ADDLW <= opc && opc <= C_XORLW && opc != C_MOVLB &&
+        opc != C_MOVLP);
+}
+
+
+//// Peephole (forward, optional) ////
+// movlw k when W is k, movf f, w or movwf f when W is f : remove
+// bcf/bsf on a STATUS bit that's known or never read : remove
+// anything else setting only W and STATUS, when they're never read : remove
+// bcf/bsf f, b followed by bcf/bsf f, b : remove the first
+// movlw 0 then movwf f : clrf f, if W and Z aren't read after
+// goto/bra to the next line : remove
+//
+// What's in W and STATUS is followed forward, starting over with nothing
+// known at each label. What might be read later is found backward, taking
+// everything to be read after a jump, a call or a return and going into a
+// label. Only plain GPR is assumed to keep what was written to it, and
+// with an interrupt routine, only GPR and common RAM it never writes,
+// since it could run between the two lines. Nothing is taken out right
+// after a skip, in a table after brw or a write to PCL, or up to the
+// interrupt vector, and starred lines are left alone.
+static
+struct line* opt_peephole(struct emr* const ctx, struct line* start)
+{
+    const struct insn* oi_clrf = insn_lookup("clrf", 4);
+    unsigned int saved = 0;
+
+    for (unsigned int round = 0; round < 8; ++round) {
+        struct line** lines;
+        int* label_idx;
+        size_t n = line_array(ctx, start, &lines, &label_idx);
+
+        unsigned int* live = arena_alloc(&ctx->arena,
+            n * sizeof(unsigned int));
+        bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        bool* dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+        size_t i;
+        for (i = n; i-- > 0; /* */) {
+            unsigned int use, def;
+            line_uses(lines[i], &use, &def);
+            live[i] = (live_after(lines, n, live, i) & ~def) | use;
+            dead[i] = false;
+        }
+        mark_tables(lines, n, table);
+        size_t isr = vector_line(lines, n);
+        const bool* shared = isr_writes(ctx, lines, n, label_idx, isr);
+
+        bool changed = false;
+        struct wstate s = wstate_unknown;
+        for (i = 0; i < n; ++i) {
+            struct line* line = lines[i];
+            enum opcode opc = line->oi->opc;
+            bool after_skip = (i > 0 && is_skip(lines[i - 1]->oi->opc));
+
+            if (line->label != SYM_NONE || i == isr || table[i] ||
+                    (i > 0 && !falls_through(lines[i - 1]->oi->opc)))
+                s = wstate_unknown;
+
+            const unsigned int out = live_after(lines, n, live, i);
+            const int key = gpr_key(ctx, line);
+            const bool copy = (key >= 0 && key == s.w_reg &&
+                (shared == NULL || !shared[key]));
+            const int k = line->opds[0].i;
+            struct line* next = (i + 1 < n) ? lines[i + 1] : NULL;
+            bool next_ok = (next != NULL && next->label == SYM_NONE &&
+                !next->star);
+
+            bool drop = false;
+            if (line->star || after_skip || table[i] || is_skip(opc) ||
+                    (isr != SIZE_MAX && i <= isr)) {
+                // (Left alone.)
+            } else if (opc == C_MOVLW && s.w == k) {
+                drop = true;
+            } else if (opc == C_MOVF && to_w(line) && copy &&
+                    !(out & PV_Z)) {
+                drop = true;
+            } else if (opc == C_MOVWF && copy) {
+                drop = true;
+            } else if ((opc == C_BCF || opc == C_BSF) && k == 0x03 &&
+                    line->opds[1].i <= 2) {
+                unsigned int bit = 1u << line->opds[1].i;
+                bool set = (s.flags & bit) != 0;
+                drop = !(out & bit) ||
+                    ((s.known & bit) && set == (opc == C_BSF));
+            } else if (only_sets_w(ctx, line)) {
+                unsigned int use, def;
+                line_uses(line, &use, &def);
+                if (opc == C_MOVLW && k == 0 && next_ok &&
+                        next->oi->opc == C_MOVWF && next->opds[0].i != 0x03
+                        && !(live_after(lines, n, live, i + 1) &
+                        (PV_W | PV_Z))) {
+                    next->oi = oi_clrf;
+                    drop = true;
+                } else {
+                    drop = !(def & out);
+                }
+            } else if ((opc == C_BCF || opc == C_BSF) && key >= 0 &&
+                    next_ok && (next->oi->opc == C_BCF ||
+                    next->oi->opc == C_BSF) && gpr_key(ctx, next) == key &&
+                    next->opds[1].i == line->opds[1].i) {
+                drop = true;
+            } else if ((opc == C_GOTO || opc == C_BRA) &&
+                    line->opds[0].sym != SYM_NONE &&
+                    label_idx[line->opds[0].sym] == (int)i + 1) {
+                drop = true;
+            }
+
+            if (drop) {
+                dead[i] = true;
+                changed = true;
+                ++saved;
+                continue;
+            }
+            struct wstate after = wstate_step(ctx, line, s);
+            if (key >= 0 && shared != NULL && shared[key] && to_w(line)) {
+                // (What it read may have just changed.)
+                after.w = after.w_reg = -1;
+                after.known &= ~flags_set(opc);
+                after.flags &= after.known;
+            }
+            s = after_skip ? wstate_meet(s, after) : after;
+        }
+
+        if (!changed)
+            break;
+        start = drop_dead(lines, n, dead);
+    }
+
+    if (ctx->verbosity >= 1)
+        fprintf(ctx->list, "Peephole: %u words saved\n\n", saved);
+
+    return start;
+}
+
+
+// Flow states besides a bank or page number.
+#define FLOW_UNSEEN -2 // (not reached yet)
+#define FLOW_UNKNOWN -1
+
+
+static inline
+int flow_meet(int a, int b)
+{
+    if (a == FLOW_UNSEEN)
+        return b;
+    if (b == FLOW_UNSEEN || a == b)
+        return a;
+    return FLOW_UNKNOWN;
+}
+
+
+// Dataflow over the lines in order, for a register whose value either is
+// known or isn't.
+struct flow {
+    struct line** lines;
+    int* targets; // (index of the line jumped to, negative if none)
+    size_t n;
+    bool computed; // (whether anything jumps to a computed address)
+
+    // State after line i, given the state before it.
+    int (*step)(const struct flow* fl, size_t i, int state);
+    const void* arg;
+
+    int* in; // (state on entry to each line)
+    int ret; // (state on return from any call)
+    bool* queued;
+    size_t* work;
+    size_t top;
+};
+
+
+static inline
+void flow_queue(struct flow* const fl, size_t i)
+{
+    if (!fl->queued[i]) {
+        fl->queued[i] = true;
+        fl->work[fl->top++] = i;
+    }
+}
+
+
+static inline
+void flow_join(struct flow* const fl, size_t i, int state)
+{
+    int old = fl->in[i];
+    fl->in[i] = flow_meet(old, state);
+    if (fl->in[i] != old)
+        flow_queue(fl, i);
+}
+
+
+// Find the state on entry to each line reached from reset, where it's
+// reset_state, or from the line at the interrupt vector. A call comes back
+// with whatever any return leaves; retfie doesn't count, since the state
+// is restored from the shadow registers then.
+static
+void flow_run(struct flow* const fl, int reset_state, size_t isr)
+{
+    struct line** const lines = fl->lines;
+    const size_t n = fl->n;
+
+    for (size_t i = 0; i < n; ++i) {
+        fl->in[i] = FLOW_UNSEEN;
+        fl->queued[i] = false;
+    }
+    fl->ret = FLOW_UNSEEN;
+    for (size_t i = n; i-- > 0; /* */) {
+        if (i == isr || (fl->computed && lines[i]->label != SYM_NONE))
+            flow_join(fl, i, FLOW_UNKNOWN);
+        if (i == 0)
+            flow_join(fl, i, reset_state);
+    }
+
+    while (fl->top > 0) {
+        size_t i = fl->work[--fl->top];
+        fl->queued[i] = false;
+
+        enum opcode opc = lines[i]->oi->opc;
+        int state = fl->step(fl, i, fl->in[i]);
+
+        if (fl->targets[i] >= 0)
+            flow_join(fl, fl->targets[i], state);
+        if (opc == C_RETURN || opc == C_RETLW) {
+            int ret = flow_meet(fl->ret, state);
+            if (ret != fl->ret) {
+                fl->ret = ret;
+                for (size_t j = 0; j < n; ++j) {
+                    enum opcode opc_j = lines[j]->oi->opc;
+                    if ((opc_j == C_CALL || opc_j == C_CALLW) &&
+                            fl->in[j] != FLOW_UNSEEN)
+                        flow_queue(fl, j);
+                }
+            }
+        }
+        if (opc == C_CALL || opc == C_CALLW)
+            state = fl->ret;
+        if (state == FLOW_UNSEEN)
+            continue;
+
+        if (falls_through(opc) && i + 1 < n)
+            flow_join(fl, i + 1, state);
+        if (is_skip(opc) && i + 2 < n)
+            flow_join(fl, i + 2, state);
+
+        // brw goes into the table after it, which ends with the first line
+        // that doesn't jump away itself.
+        if (opc == C_BRW) {
+            for (size_t j = i + 1; j < n; ++j) {
+                flow_join(fl, j, state);
+                if (falls_through(lines[j]->oi->opc))
+                    break;
+            }
+        }
+    }
+}
+
+
+// Fill in the targets and computed from the lines, using label_idx.
+static
+void flow_init(struct flow* const fl, const int* const label_idx)
+{
+    fl->computed = false;
+    for (size_t i = 0; i < fl->n; ++i) {
+        const struct line* line = fl->lines[i];
+        enum opcode opc = line->oi->opc;
+
+        fl->targets[i] = -1;
+        if (opc == C_BRA || opc == C_GOTO || opc == C_CALL) {
+            if (line->opds[0].sym == SYM_NONE)
+                fl->computed = true;
+            else
+                fl->targets[i] = label_idx[line->opds[0].sym];
+        }
+        if (opc == C_CALLW || writes_creg(line, 0x02))
+            fl->computed = true;
+    }
+}
+
+
+// Bank state after line, given the state before it and the bank to select
+// above it (if any).
+static inline
+int bank_after(const struct line* line, int need, int bank)
+{
+    if (need >= 0)
+        bank = need;
+    if (line->bank >= 0)
+        bank = line->bank;
+    if (line->oi->opc == C_MOVLB)
+        bank = line->opds[0].i;
+    if (writes_creg(line, 0x08))
+        bank = FLOW_UNKNOWN;
+    return bank;
+}
+
+
+static
+int bank_step(const struct flow* const fl, size_t i, int bank)
+{
+    const int* const need = fl->arg;
+    return bank_after(fl->lines[i], need[i], bank);
+}
+
+
+// Bank state on entry to line i once flow_run() is done. Lines that can't
+// be reached just follow on from the line before, as given by last.
+static inline
+int bank_before(const struct flow* const fl, size_t i, int last)
+{
+    if (fl->in[i] != FLOW_UNSEEN)
+        return fl->in[i];
+    return (fl->lines[i]->label == SYM_NONE) ? last : FLOW_UNKNOWN;
+}
+
+
+// Bank state after line i, for the next line to follow on from.
+static inline
+int bank_next(const struct flow* const fl, size_t i, int bank)
+{
+    enum opcode opc = fl->lines[i]->oi->opc;
+    if (opc == C_CALL || opc == C_CALLW)
+        return FLOW_UNKNOWN;
+    return bank_after(fl->lines[i], -1, bank);
+}
+
+
+static
+void flow_alloc(struct emr* const ctx, struct flow* const fl,
+        struct line** const lines, size_t n)
+{
+    fl->lines = lines;
+    fl->n = n;
+    fl->targets = arena_alloc(&ctx->arena, n * sizeof(int));
+    fl->in = arena_alloc(&ctx->arena, n * sizeof(int));
+    fl->queued = arena_alloc(&ctx->arena, n * sizeof(bool));
+    fl->work = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    fl->top = 0;
+}
+
+
+//// A1b (reverse) ////
+// ___f___ : insert movlb if bank not known to be active
+//
+// The bank on entry to a line is known when every way of reaching it
+// leaves the same bank selected. Reset and the interrupt vector leave it
+// unknown. A line after a skip can't have its own movlb, so the skips and
+// the line get one above them. If anything jumps to a computed address,
+// every label is taken to leave the bank unknown instead.
+static
+struct line* assemble_banks(struct emr* const ctx, struct line* start)
+{
+    const struct insn* oi_movlb = insn_lookup("movlb", 5);
+
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+
+    int* need = arena_alloc(&ctx->arena, n * sizeof(int));
+    struct flow fl = { .step = bank_step, .arg = need };
+    flow_alloc(ctx, &fl, lines, n);
+    flow_init(&fl, label_idx);
+
+    size_t i;
+    for (i = 0; i < n; ++i)
+        need[i] = lines[i]->star ? -1 : lines[i]->bank;
+
+    // Move the bank each line needs up to the first of any skips before it.
+    for (i = 0; i < n; /* */) {
+        size_t end = i;
+        while (end + 1 < n && is_skip(lines[end]->oi->opc))
+            ++end;
+        for (size_t j = i + 1; j <= end; ++j) {
+            if (need[j] < 0)
+                continue;
+            if (need[i] >= 0 && need[i] != need[j])
+                fatal(E_COMMON, "%u: Can't select bank %d here; a skip "
+                    "before needs bank %d", lines[j]->num, need[j],
+                    need[i]);
+            need[i] = need[j];
+            need[j] = -1;
+        }
+        i = end + 1;
+    }
+
+    // The interrupt vector is at address 4. Which line ends up there
+    // depends on the movlb lines put in before it, which depend on which
+    // line is there, so try each line that could be until one agrees.
+    // Every goto and call still has its movlp at this point.
+    size_t isr = vector_line(lines, n);
+    for (unsigned int tries = 0; /* */; ++tries) {
+        flow_run(&fl, FLOW_UNKNOWN, isr);
+        if (isr == SIZE_MAX)
+            break;
+
+        size_t at = SIZE_MAX;
+        bool split = false; // (whether its movlb is just before 4)
+        int addr = 0;
+        int last = FLOW_UNKNOWN;
+        for (i = 0; i < n && at == SIZE_MAX; ++i) {
+            int bank = bank_before(&fl, i, last);
+            if (need[i] >= 0 && bank != need[i]) {
+                bank = need[i];
+                if (++addr == 4) {
+                    at = i;
+                    split = true;
+                }
+            }
+            last = bank_next(&fl, i, bank);
+            addr += line_words(lines, n, i);
+            if (addr > 4 && at == SIZE_MAX)
+                at = i;
+        }
+        if (at == isr && split)
+            fatal(E_COMMON, "%u: movlb for this line would be just before "
+                "the interrupt vector", lines[at]->num);
+        if (at == isr)
+            break;
+        if (tries == 4)
+            fatal(E_COMMON, "%u: Can't select banks around the interrupt "
+                "vector", lines[at]->num);
+        isr = at;
+    }
+
+    // Apply the result.
+    int last = FLOW_UNKNOWN;
     struct line* prev = NULL;
-    struct line* line = start;
-    while (line != NULL) {
-        enum opcode opc = line->oi->opc;
+    for (i = 0; i < n; ++i) {
+        struct line* line = lines[i];
 
-        // Store label info.
-        struct label* li = NULL;
-        if (line->label != NULL) {
-            li = dict_avail(&labels, line->label);
-            li->name = line->label;
-            li->addr = addr;
-        }
-
-        // Handle bra.
-        if (opc == C_BRA) {
-            struct label* tgt = dict_get(&labels, line->opds[0].s);
-            if (tgt != NULL) {
-                if ((addr - 1) - tgt->addr > 255) { // forward limit
-                    if (line->star)
-                        fatal(E_COMMON, "%u: Target out of range (%d)",
-                            line->num, (addr - 1) - tgt->addr);
-                    if (li != NULL)
-                        ++li->addr;
-                    line->oi = oi_goto;
-
-                    struct line* new = append_line(line);
-                    line->next = prev;
-                    new->oi = oi_movlp;
-                    new->star = false;
-                    new->opds[0].i = line->opds[0].i;
-                    new->opds[0].s = line->opds[0].s;
-
-                    if (verbosity >= 2) {
-                        printf("[0x%04X] ", addr);
-                        print_line(new);
-                        putchar('\n');
+        int bank = bank_before(&fl, i, last);
+        if (need[i] >= 0 && bank != need[i]) {
+            struct line* new = insert_line(ctx, line);
+            new->oi = oi_movlb;
+            new->star = false;
+            new->opds[0].i = need[i];
+            new->opds[0].sym = SYM_NONE;
+            if (prev != NULL)
+                prev->next = new;
+            else
+                start = new;
+            bank = need[i];
+        }
+
+        if (line->bank >= 0 && bank != line->bank) {
+            if (!line->star)
+                fatal(E_COMMON, "%u: Can't select bank %d here; the line "
+                    "before is a skip", line->num, line->bank);
+            if (bank >= 0)
+                fatal(E_COMMON, "%u: Bank %d is active; star prevents "
+                    "changing to bank %d", line->num, bank, line->bank);
+        }
+
+        last = bank_next(&fl, i, bank);
+        prev = line;
+    }
+
+    return start;
+}
+
+
+// Where everything is in one try at laying out the lines.
+struct layout {
+    int* addrs; // (start of each line, with anything put above it)
+    int* slot; // (the jump whose movlp goes above each line, or -1)
+    bool* far; // (whether each jump has a movlp)
+    int* page_of; // (the line whose target's page each movlp selects)
+    bool* wide; // (whether each bra became a goto)
+    size_t* above; // (the line each jump's movlp goes above)
+    const int* label_idx;
+};
+
+
+static inline
+int layout_page(const struct layout* const lo, int idx)
+{
+    return (idx >= 0) ? lo->addrs[idx] >> 11 : FLOW_UNKNOWN;
+}
+
+
+static
+int page_step(const struct flow* const fl, size_t i, int page)
+{
+    const struct layout* const lo = fl->arg;
+    const struct line* const line = fl->lines[i];
+
+    int jump = lo->slot[i];
+    if (jump >= 0 && lo->far[jump])
+        page = layout_page(lo, fl->targets[lo->page_of[jump]]);
+    if (line->oi->opc == C_MOVLP) {
+        if (line->opds[0].sym == SYM_NONE)
+            page = line->opds[0].i >> 3;
+        else
+            page = layout_page(lo, lo->label_idx[line->opds[0].sym]);
+    }
+    if (writes_creg(line, 0x0A))
+        page = FLOW_UNKNOWN;
+    return page;
+}
+
+
+// Lay out the lines, as described for A2 below, without changing them.
+static
+void layout_lines(struct emr* const ctx, struct line** const lines,
+        const size_t n, const int* const label_idx, struct layout* const lo,
+        struct flow* const fl)
+{
+    lo->addrs = arena_alloc(&ctx->arena, (n + 1) * sizeof(int));
+    lo->slot = arena_alloc(&ctx->arena, n * sizeof(int));
+    lo->far = arena_alloc(&ctx->arena, n * sizeof(bool));
+    lo->page_of = arena_alloc(&ctx->arena, n * sizeof(int));
+    lo->wide = arena_alloc(&ctx->arena, n * sizeof(bool));
+    lo->above = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    lo->label_idx = label_idx;
+    fl->step = page_step;
+    fl->arg = lo;
+    flow_alloc(ctx, fl, lines, n);
+    flow_init(fl, label_idx);
+
+    bool* fixed = arena_alloc(&ctx->arena, n * sizeof(bool));
+
+    bool has_isr = false;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (lines[i]->oi->opc == C_RETFIE)
+            has_isr = true;
+        lo->slot[i] = -1;
+    }
+    for (i = 0; i < n; ++i) {
+        enum opcode opc = lines[i]->oi->opc;
+
+        int entry = table_goto(lines, n, i);
+        lo->wide[i] = false;
+        lo->far[i] = is_far(lines[i]) || entry >= 0;
+        lo->page_of[i] = (entry >= 0) ? entry : (int)i;
+        lo->above[i] = i;
+        if (lo->far[i] || (opc == C_BRA && !lines[i]->star)) {
+            while (lo->above[i] > 0 &&
+                    is_skip(lines[lo->above[i] - 1]->oi->opc))
+                --lo->above[i];
+            lo->slot[lo->above[i]] = i;
+        }
+    }
+
+    for (unsigned int round = 0; /* */; ++round) {
+        lo->addrs[0] = 0;
+        for (i = 0; i < n; ++i) {
+            int jump = lo->slot[i];
+            lo->addrs[i + 1] = lo->addrs[i] + 1
+                + ((jump >= 0 && lo->far[jump]) ? 1 : 0);
+        }
+
+        // Leave the vector area as it was laid out first.
+        if (round == 0) {
+            for (i = 0; i < n; ++i)
+                fixed[i] = has_isr && lo->addrs[lo->above[i]] < 4;
+        }
+
+        // Widen any short bra that's out of range.
+        bool changed = false;
+        for (i = 0; i < n; ++i) {
+            if (lines[i]->oi->opc != C_BRA || fl->targets[i] < 0 ||
+                    lo->wide[i] || lines[i]->star)
+                continue;
+            int offset = lo->addrs[fl->targets[i]] - lo->addrs[i + 1];
+            if (offset < -256 || offset > 255) {
+                lo->wide[i] = true;
+                lo->far[i] = true;
+                changed = true;
+            }
+        }
+        if (changed)
+            continue;
+
+        size_t isr = SIZE_MAX;
+        for (i = 0; has_isr && i < n && isr == SIZE_MAX; ++i)
+            if (lo->addrs[i + 1] > 4)
+                isr = i;
+        flow_run(fl, 0, isr);
+
+        // Give each jump a movlp if it needs one, and after a while, only
+        // ever add them, in case two jumps keep trading places.
+        for (i = 0; i < n; ++i) {
+            int target = fl->targets[lo->page_of[i]];
+            if (!(is_far(lines[i]) || lo->wide[i] || lo->page_of[i] != (int)i)
+                    || target < 0)
+                continue;
+            int page = layout_page(lo, target);
+            bool need = fixed[i] || fl->in[lo->above[i]] != page;
+            if (need != lo->far[i] && (need || round < 16)) {
+                lo->far[i] = need;
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+    }
+}
+
+
+static inline
+uint64_t hash_line(uint64_t h, const struct line* line)
+{
+    const int fields[] = { line->oi->opc, line->star, line->bank,
+        line->opds[0].i, line->opds[0].sym, line->opds[1].i,
+        line->opds[1].sym };
+    for (size_t k = 0; k < lengthof(fields); ++k)
+        h = (h ^ (uint32_t)fields[k]) * UINT64_C(0x100000001B3);
+    return h;
+}
+
+
+// A run of lines by its hash, so sorting puts copies together.
+struct run_hash {
+    uint64_t hash;
+    size_t at; // (line it starts at, or for a tail, ends at)
+};
+
+
+// Lowest hash first, then earliest run.
+static
+int compare_run_hash(const void* a, const void* b)
+{
+    const struct run_hash* ra = a;
+    const struct run_hash* rb = b;
+    if (ra->hash != rb->hash)
+        return (ra->hash > rb->hash) - (ra->hash < rb->hash);
+    return (ra->at > rb->at) - (ra->at < rb->at);
+}
+
+
+// Words in a page of program memory.
+#define PAGE_WORDS 0x800
+
+// Hardware stack levels on the enhanced midrange.
+#define STACK_LEVELS 16
+
+// Longest run of lines looked for to outline.
+#define OUTLINE_MAX_LINES 16
+
+
+// Give line i a label if it doesn't have one, returning it.
+static
+int need_label(struct emr* const ctx, struct line* const line,
+        const char* const prefix, unsigned int* const serial)
+{
+    if (line->label == SYM_NONE) {
+        char name[32];
+        int len = snprintf(name, sizeof(name), "@%s%u", prefix, ++*serial);
+        line->label = sym_intern(&ctx->syms, name, len);
+    }
+    return line->label;
+}
+
+
+// Whether line i can go into an outlined subroutine: it isn't in a loop or
+// a table, doesn't jump or return, and isn't up to the interrupt vector.
+static inline
+bool can_outline(struct line** const lines, const size_t i,
+        const uint64_t* const weight, const bool* const table,
+        const size_t isr)
+{
+    enum opcode opc = lines[i]->oi->opc;
+    return weight[i] <= 1 && !table[i] && (isr == SIZE_MAX || i > isr) &&
+        falls_through(opc) && opc != C_CALL && opc != C_CALLW &&
+        opc != C_MOVLP && !writes_creg(lines[i], 0x02);
+}
+
+
+//// Outline (forward, optional) ////
+// same lines ending in a jump or return as elsewhere : goto the other copy
+// same lines as elsewhere, more than once : call a subroutine with them
+//
+// Runs of lines are found by hashing them. Tails that are the same are
+// merged first, longest first out of each pair that ends the same way, by
+// replacing one with a goto to the other. Then runs of straight-line code
+// that come up more than once go into a subroutine after the last line, as
+// long as that doesn't fall through, and the copies become calls. Either
+// one makes the code that's replaced slower, so nothing in a loop is
+// replaced, and outlining stops short of the hardware stack, if its depth
+// can be told at all. A run can't have a label after its first line or
+// start after a skip, and nothing in a table or up to the interrupt vector
+// is touched. The words saved are reported for each.
+static
+struct line* opt_outline(struct emr* const ctx, struct line* start)
+{
+    const struct insn* oi_goto = insn_lookup("goto", 4);
+    const struct insn* oi_call = insn_lookup("call", 4);
+    const struct insn* oi_return = insn_lookup("return", 6);
+    unsigned int serial = 0;
+
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+    struct layout lo;
+    struct flow fl;
+    layout_lines(ctx, lines, n, label_idx, &lo, &fl);
+    const int len_before = lo.addrs[n];
+
+    // Merge tails.
+    for (unsigned int round = 0; round < 16; ++round) {
+        if (round > 0)
+            n = line_array(ctx, start, &lines, &label_idx);
+        uint64_t* weight = arena_alloc(&ctx->arena, n * sizeof(uint64_t));
+        loop_weights(ctx, lines, n, label_idx, weight);
+        bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        mark_tables(lines, n, table);
+        const size_t isr = vector_line(lines, n);
+        bool* used = arena_alloc(&ctx->arena, n * sizeof(bool));
+        bool* dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+        struct run_hash* runs = arena_alloc(&ctx->arena,
+            n * sizeof(struct run_hash));
+
+        size_t m = 0;
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            used[i] = dead[i] = false;
+            if (!falls_through(lines[i]->oi->opc) && !table[i] &&
+                    lines[i]->oi->opc != C_BRW)
+                runs[m++] = (struct run_hash){
+                    .hash = hash_line(0, lines[i]), .at = i };
+        }
+        qsort(runs, m, sizeof(struct run_hash), compare_run_hash);
+
+        bool changed = false;
+        for (size_t p = 0; p < m; ++p) {
+            for (size_t q = p + 1; q < m && q < p + 8 &&
+                    runs[q].hash == runs[p].hash; ++q) {
+                const size_t a = runs[p].at;
+                const size_t b = runs[q].at;
+
+                size_t len = 0;
+                while (len <= a && b - len > a && !used[a - len] &&
+                        !used[b - len] &&
+                        same_line(lines[a - len], lines[b - len]))
+                    ++len;
+
+                // Take out whichever copy leaves more.
+                size_t best = 0;
+                size_t out = 0;
+                for (int side = 0; side < 2; ++side) {
+                    const size_t end = (side == 0) ? b : a;
+                    size_t k = 1;
+                    while (k < len && lines[end - k + 1]->label == SYM_NONE
+                            && !table[end - k + 1])
+                        ++k;
+                    for (/* */; k >= 3; --k) {
+                        size_t s = end - k + 1;
+                        if (!table[s] && weight[s] <= 1 &&
+                                (isr == SIZE_MAX || s > isr) &&
+                                !(s > 0 && is_skip(lines[s - 1]->oi->opc)))
+                            break;
+                    }
+                    if (k >= 3 && k > best) {
+                        best = k;
+                        out = end;
                     }
+                }
+                if (best == 0)
+                    continue;
+
+                const size_t keep = (out == b) ? a : b;
+                const size_t s = out - best + 1;
+                struct line* line = lines[s];
+                int sym = need_label(ctx, lines[keep - best + 1], "tail",
+                    &serial);
+                if (ctx->verbosity >= 1)
+                    fprintf(ctx->list, "Tail merge: %zu lines at %u into "
+                        "%u, %zu words saved\n", best, line->num,
+                        lines[keep - best + 1]->num, best - 1);
+                line->oi = oi_goto;
+                line->star = false;
+                line->bank = -1;
+                line->opds[0].i = 0;
+                line->opds[0].sym = sym;
+                line->opds[1].i = 0;
+                line->opds[1].sym = SYM_NONE;
+                for (size_t k = 0; k < best; ++k) {
+                    used[out - k] = used[keep - k] = true;
+                    if (k + 1 < best)
+                        dead[out - k] = true;
+                }
+                changed = true;
+                break;
+            }
+        }
 
-                    ++addr;
-                    prev = line;
-                    line = new;
-                } else {
-                    line->star = true;
+        start = drop_dead(lines, n, dead);
+        if (!changed)
+            break;
+    }
+
+    // Outline repeated runs.
+    for (unsigned int round = 0; round < 64; ++round) {
+        n = line_array(ctx, start, &lines, &label_idx);
+        if (n == 0 || falls_through(lines[n - 1]->oi->opc))
+            break;
+        int depth = stack_depth(ctx, lines, n, label_idx);
+        if (depth < 0 || depth + 1 > STACK_LEVELS)
+            break;
+        uint64_t* weight = arena_alloc(&ctx->arena, n * sizeof(uint64_t));
+        loop_weights(ctx, lines, n, label_idx, weight);
+        bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        mark_tables(lines, n, table);
+        const size_t isr = vector_line(lines, n);
+        bool* ok = arena_alloc(&ctx->arena, n * sizeof(bool));
+        struct run_hash* runs = arena_alloc(&ctx->arena,
+            n * sizeof(struct run_hash));
+        size_t* run = arena_alloc(&ctx->arena, n * sizeof(size_t));
+        size_t* best_run = arena_alloc(&ctx->arena, n * sizeof(size_t));
+        size_t i;
+        for (i = 0; i < n; ++i)
+            ok[i] = can_outline(lines, i, weight, table, isr);
+
+        // A call is two words once there's more than one page.
+        const int call_words = (n > PAGE_WORDS) ? 2 : 1;
+
+        int best_gain = 0;
+        size_t best_len = 0;
+        size_t best_count = 0;
+        for (size_t len = 3; len <= OUTLINE_MAX_LINES; ++len) {
+            size_t m = 0;
+            for (size_t s = 0; s + len <= n; ++s) {
+                if (s > 0 && is_skip(lines[s - 1]->oi->opc))
+                    continue;
+                if (is_skip(lines[s + len - 1]->oi->opc))
+                    continue;
+                uint64_t h = 0;
+                size_t k;
+                for (k = 0; k < len; ++k) {
+                    if (!ok[s + k] ||
+                            (k > 0 && lines[s + k]->label != SYM_NONE))
+                        break;
+                    h = hash_line(h, lines[s + k]);
+                }
+                if (k == len)
+                    runs[m++] = (struct run_hash){ .hash = h, .at = s };
+            }
+            qsort(runs, m, sizeof(struct run_hash), compare_run_hash);
+
+            for (size_t p = 0; p < m; /* */) {
+                size_t q = p + 1;
+                while (q < m && runs[q].hash == runs[p].hash)
+                    ++q;
+
+                // Copies of the first, not overlapping.
+                const size_t first = runs[p].at;
+                size_t count = 0;
+                size_t end = 0;
+                for (size_t r = p; r < q; ++r) {
+                    size_t s = runs[r].at;
+                    if (count > 0 && s < end)
+                        continue;
+                    size_t k;
+                    for (k = 0; k < len; ++k)
+                        if (!same_line(lines[first + k], lines[s + k]))
+                            break;
+                    if (k < len)
+                        continue;
+                    run[count++] = s;
+                    end = s + len;
+                }
+
+                int gain = (int)(count * len) -
+                    (int)(count * call_words + len + 1);
+                if (count >= 2 && gain > best_gain) {
+                    best_gain = gain;
+                    best_len = len;
+                    best_count = count;
+                    for (size_t r = 0; r < count; ++r)
+                        best_run[r] = run[r];
+                }
+                p = q;
+            }
+        }
+        if (best_gain <= 0)
+            break;
+
+        // Copy the run to the end as a subroutine, and call it instead.
+        struct line* last = lines[n - 1];
+        const size_t s0 = best_run[0];
+        for (size_t k = 0; k <= best_len; ++k) {
+            struct line* new = arena_alloc(&ctx->arena, sizeof(struct line));
+            if (k < best_len) {
+                *new = *lines[s0 + k];
+            } else {
+                new->oi = oi_return;
+                new->star = false;
+                new->bank = -1;
+                new->opds[0].i = new->opds[1].i = 0;
+                new->opds[0].sym = new->opds[1].sym = SYM_NONE;
+                new->num = lines[s0 + best_len - 1]->num;
+            }
+            new->label = SYM_NONE;
+            new->next = NULL;
+            last->next = new;
+            last = new;
+        }
+        int sym = need_label(ctx, lines[n - 1]->next, "out", &serial);
+
+        bool* dead = arena_alloc(&ctx->arena, n * sizeof(bool));
+        for (i = 0; i < n; ++i)
+            dead[i] = false;
+        for (size_t r = 0; r < best_count; ++r) {
+            struct line* line = lines[best_run[r]];
+            line->oi = oi_call;
+            line->star = false;
+            line->bank = -1;
+            line->opds[0].i = 0;
+            line->opds[0].sym = sym;
+            line->opds[1].i = 0;
+            line->opds[1].sym = SYM_NONE;
+            for (size_t k = 1; k < best_len; ++k)
+                dead[best_run[r] + k] = true;
+        }
+        struct line* body = lines[n - 1]->next;
+        start = drop_dead(lines, n, dead);
+        lines[n - 1]->next = body;
+
+        if (ctx->verbosity >= 1)
+            fprintf(ctx->list, "Outline: %zu copies of %zu lines at %u into "
+                "%s, %d words saved\n", best_count, best_len,
+                body->num, sym_name(&ctx->syms, sym), best_gain);
+    }
+
+    if (ctx->verbosity >= 1) {
+        n = line_array(ctx, start, &lines, &label_idx);
+        layout_lines(ctx, lines, n, label_idx, &lo, &fl);
+        fprintf(ctx->list, "Outline: %d words saved in all\n\n",
+            len_before - lo.addrs[n]);
+    }
+
+    return start;
+}
+
+
+// Weigh each line by the count the profile gives for the label at or before
+// it, or 0 before any. The profile has a label and a count on each line;
+// labels that aren't in the program are left out.
+static
+void profile_weights(struct emr* const ctx, const size_t n,
+        const int* const label_idx, uint64_t* const weight)
+{
+    const char* const text = ctx->profile;
+    const size_t len = ctx->profile_len;
+
+    bool* given = arena_alloc(&ctx->arena, n * sizeof(bool));
+    size_t i;
+    for (i = 0; i < n; ++i)
+        given[i] = false;
+
+    unsigned int num = 0;
+    for (size_t pos = 0; pos < len; /* */) {
+        ++num;
+        while (pos < len && (text[pos] == ' ' || text[pos] == '\t'))
+            ++pos;
+        size_t name = pos;
+        while (pos < len && text[pos] != ' ' && text[pos] != '\t' &&
+                text[pos] != '\n')
+            ++pos;
+        size_t name_len = pos - name;
+        while (pos < len && (text[pos] == ' ' || text[pos] == '\t'))
+            ++pos;
+        uint64_t count = 0;
+        size_t digits = 0;
+        for (; pos < len && '0' <= text[pos] && text[pos] <= '9'; ++pos) {
+            count = count * 10 + (text[pos] - '0');
+            ++digits;
+        }
+        while (pos < len && (text[pos] == ' ' || text[pos] == '\t' ||
+                text[pos] == '\r'))
+            ++pos;
+        if (pos < len && text[pos] != '\n')
+            fatal(E_COMMON, "Profile %u: Expected a label and a count",
+                num);
+        ++pos;
+        if (name_len == 0)
+            continue;
+        if (digits == 0)
+            fatal(E_COMMON, "Profile %u: Expected a label and a count",
+                num);
+
+        int sym = sym_lookup(&ctx->syms, &text[name], name_len);
+        if (sym != SYM_NONE && label_idx[sym] >= 0) {
+            weight[label_idx[sym]] = count;
+            given[label_idx[sym]] = true;
+        }
+    }
+
+    uint64_t count = 0;
+    for (i = 0; i < n; ++i) {
+        if (given[i])
+            count = weight[i];
+        weight[i] = count;
+    }
+}
+
+
+// Link the lines up in the given order, returning the first.
+static
+struct line* link_order(struct line** const lines, const size_t* const order,
+        const size_t n)
+{
+    for (size_t k = 0; k + 1 < n; ++k)
+        lines[order[k]]->next = lines[order[k + 1]];
+    lines[order[n - 1]]->next = NULL;
+    return lines[order[0]];
+}
+
+
+// How often movlps run in a layout of the lines, as weighed per line.
+static
+uint64_t movlp_cost(struct emr* const ctx, struct line* const start,
+        const uint64_t* const weight, int* const len)
+{
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+    struct layout lo;
+    struct flow fl;
+    layout_lines(ctx, lines, n, label_idx, &lo, &fl);
+
+    uint64_t cost = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (lo.slot[i] >= 0 && lo.far[lo.slot[i]])
+            cost += weight[lo.slot[i]];
+    *len = lo.addrs[n];
+    return cost;
+}
+
+
+//// Place (forward, optional) ////
+// block : move into the page of the blocks it jumps to and calls most
+//
+// The lines are cut into blocks wherever nothing falls or skips into the
+// next line. Each jump or call from one block to another weighs as much as
+// its line runs, going by the profile if there is one and loop_weights() if
+// not. Blocks are joined heaviest first while they fit in a page, counting
+// every jump as two words, and then each page is filled with whatever is
+// joined to it most. Blocks keep their source order within a group. The
+// new order is kept if its movlps, weighed the same way, run less often.
+// The block at reset stays first, along with the interrupt routine, one
+// that falls off the end stays last, and tables aren't cut. Nothing moves
+// if the program selects pages itself, with a movlp or a starred goto or
+// call, or jumps to a literal address.
+static
+struct line* opt_place(struct emr* const ctx, struct line* start)
+{
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+    if (n == 0)
+        return start;
+
+    uint64_t* weight = arena_alloc(&ctx->arena, n * sizeof(uint64_t));
+    if (ctx->profile != NULL)
+        profile_weights(ctx, n, label_idx, weight);
+    else
+        loop_weights(ctx, lines, n, label_idx, weight);
+
+    bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+    mark_tables(lines, n, table);
+    const size_t isr = vector_line(lines, n);
+
+    // Cut the lines into blocks.
+    size_t* block_of = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    size_t* first = arena_alloc(&ctx->arena, (n + 1) * sizeof(size_t));
+    size_t nb = 0;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (i == 0 || (!falls_through(lines[i - 1]->oi->opc) &&
+                !(i > 1 && is_skip(lines[i - 2]->oi->opc)) && !table[i] &&
+                (isr == SIZE_MAX || i > isr)))
+            first[nb++] = i;
+        block_of[i] = nb - 1;
+    }
+    first[nb] = n;
+    const bool falls_off = falls_through(lines[n - 1]->oi->opc);
+
+    size_t* size = arena_alloc(&ctx->arena, nb * sizeof(size_t));
+    for (size_t b = 0; b < nb; ++b)
+        size[b] = 0;
+    for (i = 0; i < n; ++i) {
+        const struct line* line = lines[i];
+        enum opcode opc = line->oi->opc;
+        int sym = line->opds[0].sym;
+        bool jump = (opc == C_BRA || opc == C_GOTO || opc == C_CALL);
+
+        if ((jump && sym == SYM_NONE) || opc == C_MOVLP ||
+                (jump && line->star && !table[i] && (opc != C_BRA ||
+                (label_idx[sym] >= 0 &&
+                block_of[label_idx[sym]] != block_of[i])))) {
+            if (ctx->verbosity >= 1)
+                fprintf(ctx->list, "Place: %u: The program selects pages "
+                    "itself\n\n", line->num);
+            return start;
+        }
+        size[block_of[i]] += (is_far(line) || (opc == C_BRA && !line->star))
+            ? 2 : 1;
+    }
+    size_t total = 0;
+    for (size_t b = 0; b < nb; ++b)
+        total += size[b];
+    if (total <= PAGE_WORDS || nb < 3) {
+        if (ctx->verbosity >= 1)
+            fputs("Place: Everything fits in one page\n\n", ctx->list);
+        return start;
+    }
+
+    // The jumps and calls between blocks, heaviest first.
+    size_t* from = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    size_t* to = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    uint64_t* edge_weight = arena_alloc(&ctx->arena, n * sizeof(uint64_t));
+    struct rank* rank = arena_alloc(&ctx->arena,
+        n * sizeof(struct rank));
+    size_t ne = 0;
+    for (i = 0; i < n; ++i) {
+        enum opcode opc = lines[i]->oi->opc;
+        int sym = lines[i]->opds[0].sym;
+        if (!(opc == C_BRA || opc == C_GOTO || opc == C_CALL) ||
+                label_idx[sym] < 0)
+            continue;
+        size_t b = block_of[label_idx[sym]];
+        if (b == block_of[i])
+            continue;
+        from[ne] = block_of[i];
+        to[ne] = b;
+        edge_weight[ne] = weight[i];
+        rank[ne] = (struct rank){ .key = weight[i], .idx = ne };
+        ++ne;
+    }
+    qsort(rank, ne, sizeof(struct rank), compare_rank_desc);
+
+    // Join them up while they fit in a page. The block with the lower index
+    // stays the root, so the one at reset is its own group's.
+    size_t* parent = arena_alloc(&ctx->arena, nb * sizeof(size_t));
+    size_t* group_size = arena_alloc(&ctx->arena, nb * sizeof(size_t));
+    for (size_t b = 0; b < nb; ++b) {
+        parent[b] = b;
+        group_size[b] = size[b];
+    }
+    const size_t last = (falls_off) ? nb - 1 : SIZE_MAX;
+    for (size_t e = 0; e < ne; ++e) {
+        size_t u = from[rank[e].idx];
+        size_t v = to[rank[e].idx];
+        if (u == last || v == last)
+            continue;
+        u = find_group(parent, u);
+        v = find_group(parent, v);
+        if (u == v || group_size[u] + group_size[v] > PAGE_WORDS)
+            continue;
+        if (v < u) {
+            size_t t = u;
+            u = v;
+            v = t;
+        }
+        parent[v] = u;
+        group_size[u] += group_size[v];
+    }
+
+    // Fill the pages in order, a group at a time: next is whichever fits
+    // in what's left of the page and is joined to it most, or failing that,
+    // the first left, which runs over into the next page.
+    bool* placed = arena_alloc(&ctx->arena, nb * sizeof(bool));
+    bool* in_page = arena_alloc(&ctx->arena, nb * sizeof(bool));
+    uint64_t* pull = arena_alloc(&ctx->arena, nb * sizeof(uint64_t));
+    size_t* group_order = arena_alloc(&ctx->arena, nb * sizeof(size_t));
+    size_t ng = 0;
+    for (size_t b = 0; b < nb; ++b)
+        placed[b] = in_page[b] = false;
+    size_t room = PAGE_WORDS;
+    for (size_t g = 0; g != SIZE_MAX; /* */) {
+        placed[g] = true;
+        group_order[ng++] = g;
+        if (group_size[g] <= room) {
+            room -= group_size[g];
+            in_page[g] = true;
+        } else {
+            room = PAGE_WORDS - (group_size[g] - room) % PAGE_WORDS;
+            for (size_t b = 0; b < nb; ++b)
+                in_page[b] = (b == g);
+        }
+
+        for (size_t b = 0; b < nb; ++b)
+            pull[b] = 0;
+        for (size_t e = 0; e < ne; ++e) {
+            size_t u = find_group(parent, from[e]);
+            size_t v = find_group(parent, to[e]);
+            if (in_page[u] && !placed[v])
+                pull[v] += edge_weight[e];
+            if (in_page[v] && !placed[u])
+                pull[u] += edge_weight[e];
+        }
+
+        g = SIZE_MAX;
+        size_t first_left = SIZE_MAX;
+        for (size_t b = 0; b < nb; ++b) {
+            if (find_group(parent, b) != b || placed[b] || b == last)
+                continue;
+            if (first_left == SIZE_MAX)
+                first_left = b;
+            if (group_size[b] <= room && (g == SIZE_MAX || pull[b] > pull[g]))
+                g = b;
+        }
+        if (g == SIZE_MAX)
+            g = first_left;
+    }
+
+    size_t* order = arena_alloc(&ctx->arena, n * sizeof(size_t));
+    size_t k = 0;
+    for (size_t j = 0; j < ng; ++j)
+        for (size_t b = 0; b < nb; ++b)
+            if (find_group(parent, b) == group_order[j])
+                for (i = first[b]; i < first[b + 1]; ++i)
+                    order[k++] = i;
+    if (last != SIZE_MAX)
+        for (i = first[last]; i < n; ++i)
+            order[k++] = i;
+
+    // Keep whichever order runs fewer movlps.
+    int len_before;
+    int len_after;
+    uint64_t cost_before = movlp_cost(ctx, start, weight, &len_before);
+    uint64_t* new_weight = arena_alloc(&ctx->arena, n * sizeof(uint64_t));
+    for (k = 0; k < n; ++k)
+        new_weight[k] = weight[order[k]];
+    start = link_order(lines, order, n);
+    uint64_t cost_after = movlp_cost(ctx, start, new_weight, &len_after);
+    bool keep = cost_after < cost_before ||
+        (cost_after == cost_before && len_after < len_before);
+    if (!keep) {
+        for (k = 0; k < n; ++k)
+            order[k] = k;
+        start = link_order(lines, order, n);
+    }
+
+    if (ctx->verbosity >= 1) {
+        fprintf(ctx->list, "Place: %zu blocks in %zu groups, movlp weight "
+            "%"PRIu64" before, %"PRIu64" after", nb, ng, cost_before,
+            cost_after);
+        if (keep)
+            fprintf(ctx->list, ", %d words saved\n\n",
+                len_before - len_after);
+        else
+            fputs(", source order kept\n\n", ctx->list);
+    }
+
+    return start;
+}
+
+
+// Whether jump i has a movlp only to reach a target in another page, with
+// its own page already selected.
+static inline
+bool veneer_site(struct line** const lines, const size_t i,
+        const struct layout* const lo, const struct flow* const fl,
+        const bool has_isr)
+{
+    int at = lo->addrs[lo->above[i]];
+    return (is_far(lines[i]) || lo->wide[i]) && lo->far[i] &&
+        fl->targets[i] >= 0 && !(has_isr && at < 4) &&
+        fl->in[lo->above[i]] == at >> 11;
+}
+
+
+//// Veneers (forward, optional) ////
+// far goto, call, bra : jump to a veneer in the same page if enough do
+//
+// A veneer is a goto to the real target with a movlp of its own, put after
+// a line that doesn't fall through. A jump with its own page selected that
+// only has a movlp to reach another page can go through a veneer in its
+// page instead, which saves a word for the jump and takes two cycles more.
+// Each page and target with at least three such jumps gets a veneer, which
+// is kept if the lines laid out again come out shorter. Nothing is put in
+// a table or before the interrupt vector.
+static
+struct line* opt_veneers(struct emr* const ctx, struct line* start)
+{
+    const struct insn* oi_goto = insn_lookup("goto", 4);
+    unsigned int made = 0;
+    unsigned int serial = 0;
+
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+    struct layout lo;
+    struct flow fl;
+    layout_lines(ctx, lines, n, label_idx, &lo, &fl);
+    const int len_before = lo.addrs[n];
+
+    bool has_isr = false;
+    size_t i;
+    for (i = 0; i < n; ++i)
+        if (lines[i]->oi->opc == C_RETFIE)
+            has_isr = true;
+
+    // Each page and target looked at already, so it isn't tried again.
+    const size_t tried_cap = n;
+    int* tried_page = arena_alloc(&ctx->arena, tried_cap * sizeof(int));
+    int* tried_sym = arena_alloc(&ctx->arena, tried_cap * sizeof(int));
+    size_t tried = 0;
+
+    for (bool kept = true; kept; /* */) {
+        kept = false;
+        bool* table = arena_alloc(&ctx->arena, n * sizeof(bool));
+        mark_tables(lines, n, table);
+        size_t* sites = arena_alloc(&ctx->arena, n * sizeof(size_t));
+
+        for (i = 0; i < n && !kept && tried < tried_cap; ++i) {
+            if (!veneer_site(lines, i, &lo, &fl, has_isr))
+                continue;
+            int page = lo.addrs[lo.above[i]] >> 11;
+            int sym = lines[i]->opds[0].sym;
+            size_t k;
+            for (k = 0; k < tried; ++k)
+                if (tried_page[k] == page && tried_sym[k] == sym)
+                    break;
+            if (k < tried)
+                continue;
+            tried_page[tried] = page;
+            tried_sym[tried] = sym;
+            ++tried;
+
+            size_t count = 0;
+            for (size_t j = i; j < n; ++j)
+                if (lines[j]->opds[0].sym == sym &&
+                        veneer_site(lines, j, &lo, &fl, has_isr) &&
+                        lo.addrs[lo.above[j]] >> 11 == page)
+                    sites[count++] = j;
+            if (count < 3)
+                continue;
+
+            // Put it after the nearest line in the page that nothing falls
+            // through or skips past, and not after a brw or a write to PCL,
+            // where it would be the first entry of the table.
+            size_t at = SIZE_MAX;
+            size_t dist = SIZE_MAX;
+            for (size_t j = 0; j < n; ++j) {
+                if (lo.addrs[j] >> 11 != page ||
+                        falls_through(lines[j]->oi->opc) || table[j] ||
+                        lines[j]->oi->opc == C_BRW ||
+                        writes_creg(lines[j], 0x02) ||
+                        (j > 0 && is_skip(lines[j - 1]->oi->opc)) ||
+                        (has_isr && lo.addrs[j] < 4))
+                    continue;
+                size_t d = (j > i) ? j - i : i - j;
+                if (d < dist) {
+                    at = j;
+                    dist = d;
                 }
             }
+            if (at == SIZE_MAX)
+                continue;
+
+            char name[32];
+            int name_len = snprintf(name, sizeof(name), "@veneer%u",
+                ++serial);
+            struct line* v = arena_alloc(&ctx->arena, sizeof(struct line));
+            v->next = lines[at]->next;
+            v->oi = oi_goto;
+            v->star = false;
+            v->label = sym_intern(&ctx->syms, name, name_len);
+            v->bank = -1;
+            v->opds[0].i = 0;
+            v->opds[0].sym = sym;
+            v->opds[1].i = 0;
+            v->opds[1].sym = SYM_NONE;
+            v->num = lines[i]->num;
+            lines[at]->next = v;
+            for (k = 0; k < count; ++k)
+                lines[sites[k]]->opds[0].sym = v->label;
+
+            struct line** new_lines;
+            int* new_label_idx;
+            size_t new_n = line_array(ctx, start, &new_lines,
+                &new_label_idx);
+            struct layout new_lo;
+            struct flow new_fl;
+            layout_lines(ctx, new_lines, new_n, new_label_idx, &new_lo,
+                &new_fl);
+
+            if (new_lo.addrs[new_n] < lo.addrs[n]) {
+                lines = new_lines;
+                label_idx = new_label_idx;
+                n = new_n;
+                lo = new_lo;
+                fl = new_fl;
+                kept = true;
+                ++made;
+                if (ctx->verbosity >= 2)
+                    fprintf(ctx->list, "Veneer to %s for %zu jumps\n",
+                        sym_name(&ctx->syms, sym), count);
+            } else {
+                lines[at]->next = v->next;
+                for (k = 0; k < count; ++k)
+                    lines[sites[k]]->opds[0].sym = sym;
+            }
         }
+    }
 
-        if (verbosity >= 2) {
-            printf("[0x%04X] ", addr);
-            print_line(line);
-            putchar('\n');
+    if (ctx->verbosity >= 1)
+        fprintf(ctx->list, "Veneers: %u made, %d words saved\n\n", made,
+            len_before - lo.addrs[n]);
+
+    return start;
+}
+
+
+//// A2 (forward) ////
+// bra : star if target near, change to goto if far
+// goto, call, far bra : insert movlp if page not known to be selected
+// label : store
+//
+// Every bra starts out short and every goto and call with a movlp. A bra
+// that's out of range is widened, and after that, PCLATH is followed
+// through the control flow graph the same way as the bank, and a movlp is
+// dropped if its page is already selected. Either one moves addresses, so
+// this repeats until nothing changes. A movlp for a line after a skip goes
+// above the skip. If there's an interrupt routine, nothing before it is
+// touched, so it stays at address 4.
+static
+struct line* assemble_pass2(struct emr* const ctx, struct line* start,
+        int* len)
+{
+    const struct insn* oi_goto = insn_lookup("goto", 4);
+    const struct insn* oi_movlp = insn_lookup("movlp", 5);
+
+    struct line** lines;
+    int* label_idx;
+    size_t n = line_array(ctx, start, &lines, &label_idx);
+
+    struct layout lo;
+    struct flow fl;
+    layout_lines(ctx, lines, n, label_idx, &lo, &fl);
+    const bool* const wide = lo.wide;
+    const size_t* const above = lo.above;
+    size_t i;
+
+    // The gotos in a table all have to be in the page its brw selects. A
+    // lookup is the brw and an entry, and the movlp above if there is one.
+    bool tables = false;
+    for (i = 0; i < n; ++i) {
+        if (lines[i]->oi->opc != C_BRW || lines[i]->opds[1].i == 0)
+            continue;
+        const int entries = lines[i]->opds[1].i;
+        int entry = table_goto(lines, n, i);
+        int page = (entry >= 0) ? layout_page(&lo, fl.targets[entry]) : -1;
+        for (size_t j = i + 1; j <= i + entries && page >= 0; ++j)
+            if (lines[j]->oi->opc == C_GOTO && fl.targets[j] >= 0 &&
+                    layout_page(&lo, fl.targets[j]) != page)
+                fatal(E_COMMON, "%u: Table goes to more than one page",
+                    lines[j]->num);
+
+        if (ctx->verbosity >= 1) {
+            if (lines[i]->label != SYM_NONE)
+                fprintf(ctx->list, "Table %s: ",
+                    sym_name(&ctx->syms, lines[i]->label));
+            else
+                fprintf(ctx->list, "Table at %u: ", lines[i]->num);
+            fprintf(ctx->list, "%d entries, %d cycles per lookup\n", entries,
+                lo.far[i] ? 5 : 4);
         }
+        tables = true;
+    }
+    if (tables && ctx->verbosity >= 1)
+        fputc('\n', ctx->list);
 
-        // Increment addr.
-        ++addr;
+    // Apply the result.
+    struct line* prev = NULL;
+    for (i = 0; i < n; ++i) {
+        struct line* line = lines[i];
+        int jump = lo.slot[i];
+
+        if (wide[i]) {
+            line->oi = oi_goto;
+        } else if (line->oi->opc == C_BRA && fl.targets[i] >= 0) {
+            int offset = lo.addrs[fl.targets[i]] - lo.addrs[i + 1];
+            if (offset < -256 || offset > 255)
+                fatal(E_COMMON, "%u: Target out of range (%d)", line->num,
+                    offset);
+            line->star = true;
+        }
 
-        // Advance to next line.
-        {
-            struct line* old_next = line->next;
-            line->next = prev;
+        int target = fl.targets[lo.page_of[i]];
+        if (above[i] != i && lo.far[i] && target >= 0 &&
+                fl.in[i] != FLOW_UNSEEN &&
+                fl.in[i] != layout_page(&lo, target))
+            fatal(E_COMMON, "%u: Can't select a page here; the line before "
+                "is a skip", line->num);
+
+        if (jump >= 0 && lo.far[jump]) {
+            struct line* new = insert_line(ctx, line);
+            new->oi = oi_movlp;
+            new->star = false;
+            new->opds[0].i = lines[lo.page_of[jump]]->opds[0].i;
+            new->opds[0].sym = lines[lo.page_of[jump]]->opds[0].sym;
+            if (prev != NULL)
+                prev->next = new;
+            else
+                start = new;
+            line = new;
+        }
+
+        for (int addr = lo.addrs[i]; line != lines[i]->next;
+                line = line->next, ++addr) {
+            if (ctx->verbosity >= 2) {
+                fprintf(ctx->list, "[0x%04X] ", addr);
+                print_line(ctx, line);
+                fputc('\n', ctx->list);
+            }
             prev = line;
-            line = old_next;
         }
     }
 
-    *len = addr;
+    // The rest of the passes count label addresses from the end. There can
+    // be more labels than pass 1 left room for.
+    *len = lo.addrs[n];
+    ctx->label_array = arena_alloc(&ctx->arena,
+        sym_count(&ctx->syms) * sizeof(int));
+    for (size_t sym = 0; sym < sym_count(&ctx->syms); ++sym)
+        ctx->label_array[sym] = (label_idx[sym] >= 0)
+            ? (*len - 1) - lo.addrs[label_idx[sym]] : -1;
 
-    if (verbosity >= 2)
-        putchar('\n');
+    if (ctx->verbosity >= 2)
+        fputc('\n', ctx->list);
 
-    return prev;
+    return start;
 }
 
 
@@ -1133,7 +4449,8 @@ struct line* assemble_pass2(struct line* start, int* len)
 // [*]bra : resolve
 // goto, call : resolve relative if target stored
 static
-struct line* assemble_pass3(struct line* start, int len)
+struct line* assemble_pass3(struct emr* const ctx, struct line* start,
+        int len)
 {
     int addr = 0;
     struct line* line = start;
@@ -1141,23 +4458,23 @@ struct line* assemble_pass3(struct line* start, int len)
         enum opcode opc = line->oi->opc;
 
         if (opc == C_BRA || opc == C_MOVPLW || opc == C_MOVPHW) {
-            struct label* li = dict_get(&labels, line->opds[0].s);
-            if (li == NULL)
+            int tgt = ctx->label_array[line->opds[0].sym];
+            if (tgt < 0)
                 fatal(E_RARE, "%u: Target should not be unknown", line->num);
-            line->opds[0].i = ((len - 1) - li->addr) - (addr + 1);
-            line->opds[0].s = NULL;
+            line->opds[0].i = ((len - 1) - tgt) - (addr + 1);
+            line->opds[0].sym = SYM_NONE;
         } else if (opc == C_GOTO || opc == C_CALL || opc == C_MOVLP) {
-            struct label* li = dict_get(&labels, line->opds[0].s);
-            if (li != NULL) {
-                line->opds[0].i = ((len - 1) - li->addr) - (addr + 1);
-                line->opds[0].s = NULL;
+            int tgt = ctx->label_array[line->opds[0].sym];
+            if (tgt >= 0) {
+                line->opds[0].i = ((len - 1) - tgt) - (addr + 1);
+                line->opds[0].sym = SYM_NONE;
             }
         }
 
-        if (verbosity >= 2) {
-            printf("[0x%04X] ", addr);
-            print_line(line);
-            putchar('\n');
+        if (ctx->verbosity >= 2) {
+            fprintf(ctx->list, "[0x%04X] ", addr);
+            print_line(ctx, line);
+            fputc('\n', ctx->list);
         }
 
         // Increment addr.
@@ -1167,8 +4484,8 @@ struct line* assemble_pass3(struct line* start, int len)
         line = line->next;
     }
 
-    if (verbosity >= 2)
-        putchar('\n');
+    if (ctx->verbosity >= 2)
+        fputc('\n', ctx->list);
 
     return start;
 }
@@ -1186,10 +4503,10 @@ struct line* link_pass1(struct line* start)
 //// L2 (forward) ////
 // goto, call : resolve absolute, insert movlp
 static
-struct line* link_pass2(struct line* start)
+struct line* link_pass2(struct emr* const ctx, struct line* start)
 {
-    /*struct insn* oi_movlp = dict_get(&insns, "movlp");*/
-    struct insn* oi_movlw = dict_get(&insns, "movlw");
+    /*const struct insn* oi_movlp = insn_lookup("movlp", 5);*/
+    const struct insn* oi_movlw = insn_lookup("movlw", 5);
 
     int addr = 0;
     struct line* line = start;
@@ -1217,10 +4534,10 @@ struct line* link_pass2(struct line* start)
             line->opds[0].i = target >> 8;
         }
 
-        if (verbosity >= 1) {
-            printf("[0x%04X] ", addr);
-            print_line(line);
-            putchar('\n');
+        if (ctx->verbosity >= 1) {
+            fprintf(ctx->list, "[0x%04X] ", addr);
+            print_line(ctx, line);
+            fputc('\n', ctx->list);
         }
 
         // Increment addr.
@@ -1230,8 +4547,8 @@ struct line* link_pass2(struct line* start)
         line = line->next;
     }
 
-    if (verbosity >= 1)
-        putchar('\n');
+    if (ctx->verbosity >= 1)
+        fputc('\n', ctx->list);
 
     return start;
 }
@@ -1245,7 +4562,7 @@ uint16_t dump_line(struct line* line)
     enum operand_type type = line->oi->opds[0];
     if (type == 0)
         return word;
-    if (line->opds[0].s != NULL)
+    if (line->opds[0].sym != SYM_NONE)
         fatal(E_RARE, "%u: Unresolved symbol", line->num);
     uint16_t num = line->opds[0].i;
 
@@ -1271,7 +4588,7 @@ uint16_t dump_line(struct line* line)
     type = line->oi->opds[1];
     if (type == 0)
         return word;
-    if (line->opds[1].s != NULL)
+    if (line->opds[1].sym != SYM_NONE)
         fatal(E_RARE, "%u: Unresolved symbol", line->num);
     num = line->opds[1].i;
     switch (line->oi->opds[1]) {
@@ -1290,60 +4607,102 @@ uint16_t dump_line(struct line* line)
 }
 
 
-void dump_hex(struct line* start, int len, int16_t* cfg)
+static
+const uint16_t* dump_image(struct emr* const ctx, struct line* start, int len)
 {
-    int addr = 0;
+    uint16_t* image = arena_alloc(&ctx->arena, len * sizeof(uint16_t));
     struct line* line = start;
-    while (addr < len) {
-        int line_count = (len - addr >= 8) ? 8 : len - addr;
-        uint8_t sum = line_count * 2 + ((addr * 2) & 0xFF) + ((addr * 2) >> 8);
-        printf(":%02X%04X00", line_count * 2, addr * 2);
-        for (int i = 0; i < line_count; ++i, ++addr) {
-            uint16_t line_bin = dump_line(line);
-            printf("%02"PRIX8"%02"PRIX8, line_bin & 0xFF, line_bin >> 8);
-            sum += (line_bin & 0xFF) + (line_bin >> 8);
-            line = line->next;
-        }
-        printf("%02"PRIX8"\n", (uint8_t)-sum);
-    }
-
-    print(":020000040001F9\n");
-    for (unsigned int a = 0; a < CFG_MEM_SIZE; ++a) {
-        if (cfg[a] < 0)
-            continue;
-        int data_hi = cfg[a] >> 8;
-        int data_lo = cfg[a] & 0xFF;
-        uint8_t sum = 2 + 2*a + data_hi + data_lo;
-        printf(":02%04X00%02X%02X%02"PRIX8"\n", a * 2, data_lo, data_hi,
-            (uint8_t)-sum);
+    for (int addr = 0; addr < len; ++addr, line = line->next)
+        image[addr] = dump_line(line);
+    return image;
+}
+
+
+// Returns NULL if out of memory.
+struct emr* emr_new(void)
+{
+    return calloc(1, sizeof(struct emr));
+}
+
+
+// Keep parsed lines from one assembly to the next, up to about max_lines
+// distinct ones before starting over. Only worth it when the same sources
+// are assembled again and again with small changes, as in server mode.
+void emr_cache_lines(struct emr* const ctx, const size_t max_lines)
+{
+    if (ctx->cache == NULL) {
+        ctx->cache = malloc(sizeof(struct line_cache));
+        if (ctx->cache == NULL)
+            fatal_e(E_COMMON, "Can't allocate line cache");
+        arena_init(&ctx->cache->arena, 0);
+        dict_init(&ctx->cache->lines, sizeof(struct parsed));
+    }
+    ctx->cache->max_lines = max_lines;
+    cache_reset(ctx);
+}
+
+
+void emr_free(struct emr* const ctx)
+{
+    if (ctx->cache != NULL) {
+        dict_free(&ctx->cache->lines);
+        arena_free(&ctx->cache->arena);
+        free(ctx->cache);
     }
-    print(":00000001FF\n");
+    if (ctx->syms.syms != NULL)
+        sym_free(&ctx->syms);
+    if (ctx->arena.first != NULL)
+        arena_free(&ctx->arena);
+    free(ctx);
 }
 
 
-void assemble_emr(const int src)
+// Assemble text into image. The listing, if any, goes to opts->list.
+// Errors go through fatal(), so callers that don't want to exit set a trap
+// first. Memory from the last assembly is reused here, and ctx is kept warm
+// for the next one.
+void assemble_emr(struct emr* const ctx, const char* const text,
+        const size_t text_len, const struct cpic_options* const opts,
+        struct cpic_image* const image)
 {
-    size_t bufpos = 0;
-    size_t buflen = 1;
+    ctx->list = opts->list;
+    ctx->verbosity = (opts->list != NULL) ? opts->verbosity : 0;
+    ctx->opt = opts->opt;
+    ctx->profile = opts->profile;
+    ctx->profile_len = opts->profile_len;
+
+    const struct srcbuf src = { .data = text, .len = text_len };
+    size_t pos = 0;
 
     struct line* start = NULL;
     struct line* prev_line = NULL;
 
-    dict_init(&insns);
-    for (unsigned int i = 0; i < lengthof(insns_ref); ++i)
-        *(struct insn*)dict_avail(&insns, insns_ref[i].str) = insns_ref[i];
+    if (ctx->arena.first == NULL)
+        arena_init(&ctx->arena, (src.len / 16 + 1) * sizeof(struct line));
+    else
+        arena_reset(&ctx->arena);
+    if (ctx->cache == NULL)
+        sym_init(&ctx->syms, &ctx->arena);
+    else if (ctx->cache->lines.count > ctx->cache->max_lines)
+        cache_reset(ctx);
 
-    char* label = NULL;
+    int label = SYM_NONE;
     for (unsigned int l = 1; /* */; ++l) {
-        struct token tokens[16];
-        lex_line(tokens, src, l, &bufpos, &buflen);
-        /*if (verbosity >= 2)*/
-            /*for (unsigned int i = 0; i < lengthof(tokens) &&*/
-                    /*tokens[i].type != T_NONE; ++i)*/
-                /*print_token(&tokens[i]);*/
-        if (buflen == 0)
-            break;
-        struct line* line = parse_line(prev_line, tokens, l, &label);
+        struct parsed parsed;
+        if (ctx->cache != NULL) {
+            if (!cached_parse(ctx, &src, l, &pos, label, &parsed))
+                break;
+        } else {
+            struct token tokens[MAX_TOKENS];
+            if (!lex_line(ctx, tokens, lengthof(tokens), &src, l, &pos))
+                break;
+            /*if (ctx->verbosity >= 2)*/
+                /*for (unsigned int i = 0; i < lengthof(tokens) &&*/
+                        /*tokens[i].type != T_NONE; ++i)*/
+                    /*print_token(ctx, &tokens[i]);*/
+            parse_tokens(tokens, l, label, &parsed);
+        }
+        struct line* line = attach_line(ctx, prev_line, &parsed, &label);
         if (line != NULL)
             line->num = l;
         if (start == NULL && line != NULL)
@@ -1351,13 +4710,35 @@ void assemble_emr(const int src)
         prev_line = line;
     }
 
+    size_t sym_cnt = sym_count(&ctx->syms);
+    ctx->reg_array = arena_alloc(&ctx->arena, sym_cnt * sizeof(struct reg));
+    ctx->creg_array = arena_alloc(&ctx->arena, sym_cnt * sizeof(struct creg));
+    ctx->label_array = arena_alloc(&ctx->arena, sym_cnt * sizeof(int));
+    ctx->inline_array = arena_alloc(&ctx->arena,
+        sym_cnt * sizeof(unsigned int));
+
     int len;
-    int16_t cfg[CFG_MEM_SIZE];
-    start = assemble_pass1(start, cfg);
-    start = assemble_pass2(start, &len);
-    start = assemble_pass3(start, len);
+    start = assemble_pass1(ctx, start, image->cfg);
+    start = reverse_lines(start);
+    start = merge_tables(ctx, start);
+    if (ctx->opt & CPIC_OPT_JUMPS)
+        start = opt_jumps(ctx, start);
+    if (ctx->opt & CPIC_OPT_INLINE)
+        start = opt_inline(ctx, start);
+    if (ctx->opt & CPIC_OPT_PEEPHOLE)
+        start = opt_peephole(ctx, start);
+    start = assemble_banks(ctx, start);
+    if (ctx->opt & CPIC_OPT_OUTLINE)
+        start = opt_outline(ctx, start);
+    if (ctx->opt & CPIC_OPT_PLACE)
+        start = opt_place(ctx, start);
+    if (ctx->opt & CPIC_OPT_VENEERS)
+        start = opt_veneers(ctx, start);
+    start = assemble_pass2(ctx, start, &len);
+    start = assemble_pass3(ctx, start, len);
     start = link_pass1(start);
-    start = link_pass2(start);
+    start = link_pass2(ctx, start);
 
-    dump_hex(start, len, cfg);
+    image->words = dump_image(ctx, start, len);
+    image->len = len;
 }
@@ -1,7 +1,17 @@
 #pragma once
 
 
-#include <stdbool.h>
+#include "libcpic.h"
 
+#include <stddef.h>
 
-void assemble_emr(const int src);
+
+struct emr;
+
+
+struct emr* emr_new(void);
+void emr_cache_lines(struct emr* const ctx, const size_t max_lines);
+void emr_free(struct emr* const ctx);
+void assemble_emr(struct emr* const ctx, const char* const src,
+    const size_t len, const struct cpic_options* const opts,
+    struct cpic_image* const image);
@@ -0,0 +1,111 @@
+#include "common.h"
+#include "arch_emr_isa.h"
+
+#include "utils.h"
+
+
+const struct insn insns_ref[] = {
+    { .opc = C_ADDWF, .str = "addwf", .word = 0x0700, .opds = {F, D} },
+    { .opc = C_ADDWFC, .str = "addwfc", .word = 0x3D00, .opds = {F, D} },
+    { .opc = C_ANDWF, .str = "andwf", .word = 0x0500, .opds = {F, D} },
+    { .opc = C_ASRF, .str = "asrf", .word = 0x3700, .opds = {F, D} },
+    { .opc = C_LSLF, .str = "lslf", .word = 0x3500, .opds = {F, D} },
+    { .opc = C_LSRF, .str = "lsrf", .word = 0x3600, .opds = {F, D} },
+    { .opc = C_CLRF, .str = "clrf", .word = 0x0180, .opds = {F, 0} },
+    { .opc = C_CLRW, .str = "clrw", .word = 0x0100, .opds = {0, 0} },
+    { .opc = C_COMF, .str = "comf", .word = 0x0900, .opds = {F, D} },
+    { .opc = C_DECF, .str = "decf", .word = 0x300, .opds = {F, D} },
+    { .opc = C_INCF, .str = "incf", .word = 0x0A00, .opds = {F, D} },
+    { .opc = C_IORWF, .str = "iorwf", .word = 0x0400, .opds = {F, D} },
+    { .opc = C_MOVF, .str = "movf", .word = 0x0800, .opds = {F, D} },
+    { .opc = C_MOVWF, .str = "movwf", .word = 0x0080, .opds = {F, 0} },
+    { .opc = C_RLF, .str = "rlf", .word = 0x0D00, .opds = {F, D} },
+    { .opc = C_RRF, .str = "rrf", .word = 0x0C00, .opds = {F, D} },
+    { .opc = C_SUBWF, .str = "subwf", .word = 0x0200, .opds = {F, D} },
+    { .opc = C_SUBWFB, .str = "subwfb", .word = 0x3B00, .opds = {F, D} },
+    { .opc = C_SWAPF, .str = "swapf", .word = 0x0E00, .opds = {F, D} },
+    { .opc = C_XORWF, .str = "xorwf", .word = 0x0600, .opds = {F, D} },
+
+    { .opc = C_DECFSZ, .str = "decfsz", .word = 0x0B00, .opds = {F, D} },
+    { .opc = C_INCFSZ, .str = "incfsz", .word = 0x0F00, .opds = {F, D} },
+
+    { .opc = C_BCF, .str = "bcf", .word = 0x1000, .opds = {F, B} },
+    { .opc = C_BSF, .str = "bsf", .word = 0x1400, .opds = {F, B} },
+
+    { .opc = C_BTFSC, .str = "btfsc", .word = 0x1800, .opds = {F, B} },
+    { .opc = C_BTFSS, .str = "btfss", .word = 0x1C00, .opds = {F, B} },
+
+    { .opc = C_ADDLW, .str = "addlw", .word = 0x3E00, .opds = {K, 0},
+        .kwid = 8 },
+    { .opc = C_ANDLW, .str = "andlw", .word = 0x3900, .opds = {K, 0},
+        .kwid = 8 },
+    { .opc = C_IORLW, .str = "iorlw", .word = 0x3800, .opds = {K, 0},
+        .kwid = 8 },
+    { .opc = C_MOVLB, .str = "movlb", .word = 0x0020, .opds = {F, 0},
+        .kwid = 5 },
+    { .opc = C_MOVLP, .str = "movlp", .word = 0x3180, .opds = {L, 0},
+        .kwid = 7 },
+    { .opc = C_MOVLW, .str = "movlw", .word = 0x3000, .opds = {K, 0},
+        .kwid = 8 },
+    { .opc = C_SUBLW, .str = "sublw", .word = 0x3C00, .opds = {K, 0},
+        .kwid = 8 },
+    { .opc = C_XORLW, .str = "xorlw", .word = 0x3A00, .opds = {K, 0},
+        .kwid = 8 },
+
+    { .opc = C_BRA, .str = "bra", .word = 0x3200, .opds = {L, 0}, .kwid = 9 },
+    { .opc = C_BRW, .str = "brw", .word = 0x000B, .opds = {0, 0} },
+    { .opc = C_CALL, .str = "call", .word = 0x2000, .opds = {L, 0},
+        .kwid = 11 },
+    { .opc = C_CALLW, .str = "callw", .word = 0x000A, .opds = {0, 0} },
+    { .opc = C_GOTO, .str = "goto", .word = 0x2800, .opds = {L, 0},
+        .kwid = 11 },
+    { .opc = C_RETFIE, .str = "retfie", .word = 0x0009, .opds = {0, 0} },
+    { .opc = C_RETLW, .str = "retlw", .word = 0x3400, .opds = {K, 0},
+        .kwid = 8 },
+    { .opc = C_RETURN, .str = "return", .word = 0x0008, .opds = {0, 0} },
+
+    { .opc = C_CLRWDT, .str = "clrwdt", .word = 0x0064, .opds = {0, 0} },
+    { .opc = C_NOP, .str = "nop", .word = 0x0000, .opds = {0, 0} },
+    { .opc = C_OPTION, .str = "option", .word = 0x0062, .opds = {0, 0} },
+    { .opc = C_RESET, .str = "reset", .word = 0x0001, .opds = {0, 0} },
+    { .opc = C_SLEEP, .str = "sleep", .word = 0x0063, .opds = {0, 0} },
+    { .opc = C_TRIS, .str = "tris", .word = 0x0060, .opds = {T, 0} },
+
+    { .opc = C_ADDFSR, .str = "addfsr", .word = 0x3100, .opds = {N, K},
+        .kwid=6 },
+    { .opc = C_MOVIW, .str = "moviw", .word = 0x0010, .opds = {M, 0} },
+    { .opc = C_MOVWI, .str = "movwi", .word = 0x0018, .opds = {M, 0} },
+
+    { .opc = C_MOVPLW, .str = "movplw", .opds = {L, 0} },
+    { .opc = C_MOVPHW, .str = "movphw", .opds = {L, 0} },
+
+    { .opc = CD_SFR, .str = ".sfr", .opds = {F, I} },
+    { .opc = CD_GPR, .str = ".gpr", .opds = {F, F} },
+    { .opc = CD_REG, .str = ".reg", .opds = {A, I} },
+    { .opc = CD_CREG, .str = ".creg", .opds = {I, 0} },
+    { .opc = CD_CFG, .str = ".cfg", .opds = {K, K}, .kwid = 16 },
+    { .opc = CD_LOCAL, .str = ".local", .opds = {L, I} },
+    { .opc = CD_INLINE, .str = ".inline", .opds = {L, 0} },
+    { .opc = CD_TABLE, .str = ".table", .opds = {L, 0} },
+    { .opc = CD_ENDTABLE, .str = ".endtable", .opds = {0, 0} },
+};
+
+const size_t insns_ref_len = lengthof(insns_ref);
+
+
+const struct creg cregs_ref[] = {
+    { .name = "INDF0", .addr = 0x00 },
+    { .name = "INDF1", .addr = 0x01 },
+    { .name = "PCL", .addr = 0x02 },
+    { .name = "STATUS", .addr = 0x03 },
+    { .name = "FSR0L", .addr = 0x04 },
+    { .name = "FSR0H", .addr = 0x05 },
+    { .name = "FSR1L", .addr = 0x06 },
+    { .name = "FSR1H", .addr = 0x07 },
+    { .name = "BSR", .addr = 0x08 },
+    { .name = "WREG", .addr = 0x09 },
+    { .name = "PCLATH", .addr = 0x0A },
+    { .name = "INTCON", .addr = 0x0B },
+};
+
+const size_t cregs_ref_len = lengthof(cregs_ref);
@@ -0,0 +1,151 @@
+#pragma once
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+enum opcode {
+    C_NONE,
+
+    C_ADDWF,
+    C_ADDWFC,
+    C_ANDWF,
+    C_ASRF,
+    C_LSLF,
+    C_LSRF,
+    C_CLRF,
+    C_CLRW,
+    C_COMF,
+    C_DECF,
+    C_INCF,
+    C_IORWF,
+    C_MOVF,
+    C_MOVWF,
+    C_RLF,
+    C_RRF,
+    C_SUBWF,
+    C_SUBWFB,
+    C_SWAPF,
+    C_XORWF,
+
+    C_DECFSZ,
+    C_INCFSZ,
+
+    C_BCF,
+    C_BSF,
+
+    C_BTFSC,
+    C_BTFSS,
+
+    C_ADDLW,
+    C_ANDLW,
+    C_IORLW,
+    C_MOVLB,
+    C_MOVLP,
+    C_MOVLW,
+    C_SUBLW,
+    C_XORLW,
+
+    C_BRA,
+    C_BRW,
+    C_CALL,
+    C_CALLW,
+    C_GOTO,
+    C_RETFIE,
+    C_RETLW,
+    C_RETURN,
+
+    C_CLRWDT,
+    C_NOP,
+    C_OPTION,
+    C_RESET,
+    C_SLEEP,
+    C_TRIS,
+
+    C_ADDFSR,
+    C_MOVIW,
+    C_MOVWI,
+
+    C_MOVPLW,
+    C_MOVPHW,
+
+    C__LAST__,
+
+    CD_SFR,
+    CD_GPR,
+    CD_REG,
+    CD_CREG,
+    CD_CFG,
+    CD_LOCAL,
+    CD_INLINE,
+    CD_TABLE,
+    CD_ENDTABLE,
+
+    CD__LAST__,
+
+    // TODO: Implement more.
+};
+
+
+enum operand_type {
+    NONE__ = 0, // none
+    F, // register
+    B, // bit number (0 - 7)
+    K, // miscellaneous number
+    L, // program address or label
+    D, // destination select (0 = W, 1 = f)
+    T, // TRIS operand (5 - 7)
+    N, // FSR number
+    M, // FSR number with pre-/post-decrement/-increment
+    A, // bank number
+    I, // new identifier
+};
+
+
+struct insn {
+    const char* str;
+    enum opcode opc;
+    uint16_t word;
+    enum operand_type opds[2];
+    int kwid;
+};
+
+
+struct creg {
+    const char* name;
+    int addr; // (negative if undefined)
+};
+
+
+extern const struct insn insns_ref[];
+extern const size_t insns_ref_len;
+extern const struct creg cregs_ref[];
+extern const size_t cregs_ref_len;
+
+
+// FNV-1a with a seed mixed in. gen_phash searches for seeds that make this
+// collision-free over insns_ref and cregs_ref, so it has to stay in sync
+// with the generated tables.
+static inline
+uint32_t isa_hash(const char* str, size_t len, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+// Pick a slot from a hash and its bucket's displacement.
+static inline
+uint32_t isa_slot(uint32_t h, uint32_t disp, uint32_t n)
+{
+    h += disp;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    return h % n;
+}
@@ -0,0 +1,36 @@
+// Generated by gen_phash from arch_emr_isa.c; don't edit.
+
+#pragma once
+
+
+#define INSN_PHASH_SEED 0x00000000u
+#define INSN_PHASH_LEN 62
+#define INSN_PHASH_BUCKETS 32
+
+static const uint16_t insn_phash_disp[] = {
+   1, 0, 0, 0, 0, 5, 1, 32, 0, 0, 1, 2,
+   3, 11, 15, 14, 17, 84, 0, 3, 30, 5, 15, 5,
+   11, 6, 5, 0, 3, 8, 67, 13,
+};
+
+static const uint8_t insn_phash_index[] = {
+   23, 52, 5, 25, 20, 10, 9, 26, 31, 8, 33, 42,
+   18, 40, 14, 16, 12, 22, 58, 35, 24, 17, 28, 45,
+   49, 32, 1, 15, 54, 29, 19, 51, 48, 61, 55, 60,
+   43, 4, 37, 30, 13, 6, 0, 27, 47, 3, 59, 57,
+   36, 2, 38, 39, 46, 34, 56, 7, 44, 53, 50, 21,
+   41, 11,
+};
+
+#define CREG_PHASH_SEED 0x00000000u
+#define CREG_PHASH_LEN 12
+#define CREG_PHASH_BUCKETS 7
+
+static const uint16_t creg_phash_disp[] = {
+   0, 1, 3, 22, 5, 5, 5,
+};
+
+static const uint8_t creg_phash_index[] = {
+   10, 9, 11, 2, 4, 0, 3, 1, 6, 5, 8, 7,
+};
+
@@ -0,0 +1,97 @@
+#include "common.h"
+#include "arena.h"
+
+#include "fail.h"
+
+
+#include <stdlib.h>
+
+
+#define MIN_BLOCK_LEN 65536
+
+
+// Every allocation is rounded up to a multiple of this, which keeps them
+// all suitably aligned for any type.
+union arena_align {
+    long long ll;
+    long double ld;
+    void* p;
+    void (*fp)(void);
+};
+
+
+struct arena_block {
+    struct arena_block* next;
+    size_t cap;
+    size_t used;
+    union arena_align data[];
+};
+
+
+static
+struct arena_block* new_block(size_t cap)
+{
+    if (cap < MIN_BLOCK_LEN)
+        cap = MIN_BLOCK_LEN;
+    struct arena_block* block = malloc(sizeof(struct arena_block) + cap);
+    if (block == NULL)
+        fatal_e(E_COMMON, "Can't allocate memory");
+    block->next = NULL;
+    block->cap = cap;
+    block->used = 0;
+    return block;
+}
+
+
+void arena_init(struct arena* const arena, size_t hint)
+{
+    arena->first = new_block(hint);
+    arena->cur = arena->first;
+}
+
+
+void* arena_alloc(struct arena* const arena, size_t len)
+{
+    len = (len + sizeof(union arena_align) - 1)
+        / sizeof(union arena_align) * sizeof(union arena_align);
+
+    struct arena_block* block = arena->cur;
+    while (block->cap - block->used < len) {
+        // Blocks after cur are left over from before the last reset, so
+        // they're empty as far as we're concerned.
+        if (block->next == NULL || block->next->cap < len) {
+            struct arena_block* new = new_block(
+                block->cap * 2 > len ? block->cap * 2 : len);
+            new->next = block->next;
+            block->next = new;
+        }
+        block = block->next;
+        block->used = 0;
+    }
+    arena->cur = block;
+
+    void* p = (char*)block->data + block->used;
+    block->used += len;
+    return p;
+}
+
+
+// Make all memory in the arena available again without giving it back.
+void arena_reset(struct arena* const arena)
+{
+    arena->cur = arena->first;
+    arena->first->used = 0;
+}
+
+
+void arena_free(struct arena* const arena)
+{
+    struct arena_block* block = arena->first;
+    while (block != NULL) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->cur = NULL;
+}
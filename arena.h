@@ -0,0 +1,19 @@
+#pragma once
+
+
+#include <stddef.h>
+
+
+struct arena_block;
+
+
+struct arena {
+    struct arena_block* first;
+    struct arena_block* cur;
+};
+
+
+void arena_init(struct arena* const arena, size_t hint);
+void* arena_alloc(struct arena* const arena, size_t len);
+void arena_reset(struct arena* const arena);
+void arena_free(struct arena* const arena);
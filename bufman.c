@@ -2,17 +2,96 @@
 #include "bufman.h"
 
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 
-ssize_t bufgrab(const int fd, char* const buf, size_t* const len,
-        const size_t chunklen, const size_t keep)
+#define READ_CHUNK_LEN 65536
+
+
+// Read everything left in fd into one heap buffer. Used for pipes and
+// anything else mmap won't take.
+static
+int bufslurp(const int fd, struct srcbuf* const sb, size_t cap)
+{
+    if (cap < READ_CHUNK_LEN)
+        cap = READ_CHUNK_LEN;
+    char* data = malloc(cap);
+    if (data == NULL)
+        return -1;
+
+    size_t len = 0;
+    while (true) {
+        if (cap - len < READ_CHUNK_LEN) {
+            char* new = realloc(data, cap * 2);
+            if (new == NULL) {
+                free(data);
+                return -1;
+            }
+            data = new;
+            cap *= 2;
+        }
+        ssize_t count = read(fd, &data[len], cap - len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            int e = errno;
+            free(data);
+            errno = e;
+            return -1;
+        } else if (count == 0) {
+            break;
+        }
+        len += count;
+    }
+
+    sb->data = data;
+    sb->len = len;
+    sb->mapped = false;
+    return 0;
+}
+
+
+int bufmap(const int fd, struct srcbuf* const sb)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            sb->data = "";
+            sb->len = 0;
+            sb->mapped = true;
+            return 0;
+        }
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+            sb->data = data;
+            sb->len = st.st_size;
+            sb->mapped = true;
+            return 0;
+        }
+        return bufslurp(fd, sb, st.st_size + 1);
+    }
+
+    return bufslurp(fd, sb, 0);
+}
+
+
+void bufunmap(struct srcbuf* const sb)
 {
-    *len -= keep;
-    memmove(buf, &buf[keep], *len);
-    ssize_t count = read(fd, &buf[*len], chunklen);
-    if (count >= 0)
-        *len += count;
-    return count;
+    if (sb->mapped) {
+        if (sb->len > 0)
+            munmap((void*)sb->data, sb->len);
+    } else {
+        free((void*)sb->data);
+    }
+    sb->data = NULL;
+    sb->len = 0;
 }
@@ -1,8 +1,16 @@
 #pragma once
 
 
-#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 
-ssize_t bufgrab(const int fd, char* const buf, size_t* const pos,
-        const size_t chunklen, const size_t keep);
+struct srcbuf {
+    const char* data;
+    size_t len;
+    bool mapped;
+};
+
+
+int bufmap(const int fd, struct srcbuf* const sb);
+void bufunmap(struct srcbuf* const sb);
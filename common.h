@@ -1,7 +1,7 @@
 #pragma once
 
 
-#define _POSIX_C_SOURCE 2
+#define _POSIX_C_SOURCE 200809L
 
 #define E_COMMON 1
 #define E_ARG 2
@@ -3,12 +3,17 @@
 
 #include "bufman.h"
 #include "fail.h"
-#include "arch_emr.h"
+#include "hexout.h"
+#include "libcpic.h"
+#include "pool.h"
+#include "serve.h"
 #include "utils.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,38 +22,99 @@
 
 const char* progname;
 int verbosity = 0;
+unsigned int jobs = 1;
+unsigned int opt = 0;
+const char* serve_path = NULL;
+const char* profile_path = NULL;
+struct srcbuf profile = { 0 };
 
 
 const char* const msg_usage =
-    "Usage:  %s [OPTIONS] FILE\n"
+    "Usage:  %s [OPTIONS] FILE...\n"
+    "        %s [OPTIONS] --serve SOCKET\n"
     "\n"
     "Arguments:\n"
-    "  FILE    the assembly file to read\n"
+    "  FILE    an assembly file to read (with more than one, each is written\n"
+    "          to FILE.hex instead of standard output)\n"
     "\n"
     "Available options:\n"
     "  -h\n"
     "      show this usage text\n"
+    "  -j N\n"
+    "      assemble up to N files (or serve up to N requests) at once\n"
+    "  -O PASS\n"
+    "      run an optional pass (can be passed more than once): peephole,\n"
+    "      jumps, inline, veneers, place, outline (peephole takes GPR and\n"
+    "      common RAM to keep what was last written to them, unless the\n"
+    "      interrupt routine writes them too)\n"
+    "  -p FILE\n"
+    "      weigh code for -O place by the counts in FILE, one label and\n"
+    "      how many times it ran per line, instead of by loop nesting\n"
+    "  --serve SOCKET\n"
+    "      listen on a Unix socket and assemble whatever clients send; see\n"
+    "      serve.c for the protocol\n"
     "  -v\n"
     "      increase verbosity (can be passed up to 2 times)\n"
     ;
 
 void exit_with_usage()
 {
-    fprintf(stderr, msg_usage, progname);
+    fprintf(stderr, msg_usage, progname, progname);
     exit(E_INFO);
 }
 
 
+// Names for -O.
+static const struct {
+    const char* name;
+    unsigned int flag;
+} opt_names[] = {
+    { "peephole", CPIC_OPT_PEEPHOLE },
+    { "jumps", CPIC_OPT_JUMPS },
+    { "inline", CPIC_OPT_INLINE },
+    { "veneers", CPIC_OPT_VENEERS },
+    { "place", CPIC_OPT_PLACE },
+    { "outline", CPIC_OPT_OUTLINE },
+};
+
+
 int process_args(int argc, char** argv)
 {
     while (true) {
-        int c = getopt(argc, argv, "hv");
+        // (getopt doesn't do long options.)
+        if (optind < argc && strcmp(argv[optind], "--serve") == 0) {
+            if (optind + 1 >= argc)
+                fatal(E_ARG, "No socket specified");
+            serve_path = argv[optind + 1];
+            optind += 2;
+            continue;
+        }
+
+        int c = getopt(argc, argv, "hj:O:p:v");
         if (c == -1) {
             break;
         } else if (c == 'h') {
             exit_with_usage();
+        } else if (c == 'j') {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1 || n > 1024)
+                fatal(E_ARG, "Invalid job count \"%s\"", optarg);
+            jobs = n;
+        } else if (c == 'O') {
+            size_t i;
+            for (i = 0; i < lengthof(opt_names); ++i)
+                if (strcmp(optarg, opt_names[i].name) == 0)
+                    break;
+            if (i == lengthof(opt_names))
+                fatal(E_ARG, "Unknown pass \"%s\"", optarg);
+            opt |= opt_names[i].flag;
+        } else if (c == 'p') {
+            profile_path = optarg;
         } else if (c == 'v') {
             ++verbosity;
+        } else {
+            exit_with_usage();
         }
     }
 
@@ -56,6 +122,155 @@ int process_args(int argc, char** argv)
 }
 
 
+// FILE with its extension (if any) replaced by ".hex".
+static
+char* hex_path(const char* const path)
+{
+    const char* base = strrchr(path, '/');
+    base = (base == NULL) ? path : base + 1;
+    const char* dot = strrchr(base, '.');
+    size_t stem = (dot == NULL || dot == base) ? strlen(path)
+        : (size_t)(dot - path);
+
+    char* out = malloc(stem + sizeof(".hex"));
+    if (out == NULL)
+        fatal_e(E_COMMON, "Can't allocate output name");
+    memcpy(out, path, stem);
+    memcpy(out + stem, ".hex", sizeof(".hex"));
+    return out;
+}
+
+
+struct batch {
+    char** paths;
+    size_t count;
+    struct cpic** asms; // (one per worker)
+    pthread_mutex_t out_lock; // (for stdout and rtn)
+    int rtn;
+};
+
+
+struct job {
+    struct batch* batch;
+    const char* path;
+};
+
+
+static
+void print_diag(void* const arg, const bool fatal, const char* const msg)
+{
+    const struct job* const job = arg;
+    (void)fatal;
+
+    if (job->batch->count == 1) {
+        fflush(stdout);
+        fprintf(stderr, "%s\n", msg);
+    } else {
+        pthread_mutex_lock(&job->batch->out_lock);
+        fprintf(stderr, "%s: %s\n", job->path, msg);
+        pthread_mutex_unlock(&job->batch->out_lock);
+    }
+}
+
+
+// Assemble one file and write it out. Returns 0 or the code to exit with.
+static
+int assemble_file(struct cpic* const cp, const struct job* const job,
+    const int out, FILE* const list)
+{
+    int src = open(job->path, O_RDONLY);
+    if (src < 0) {
+        warning_e("Can't open file \"%s\"", job->path);
+        return E_COMMON;
+    }
+
+    struct srcbuf sb;
+    if (bufmap(src, &sb) < 0) {
+        warning_e("Can't read from source file \"%s\"", job->path);
+        close(src); // (Ignore errors.)
+        return E_COMMON;
+    }
+
+    const struct cpic_options opts = {
+        .verbosity = verbosity,
+        .opt = opt,
+        .profile = profile.data,
+        .profile_len = profile.len,
+        .list = list,
+        .diag = print_diag,
+        .diag_arg = (void*)job,
+    };
+    struct cpic_image image;
+    int rtn = cpic_assemble(cp, sb.data, sb.len, &opts, &image);
+    bufunmap(&sb);
+    close(src); // (Ignore errors.)
+    if (rtn != 0)
+        return rtn;
+
+    char* hex = malloc(cpic_hex_bound(&image));
+    if (hex == NULL)
+        fatal_e(E_COMMON, "Can't allocate output buffer");
+    size_t hex_len = cpic_hex_format(&image, hex);
+
+    // The listing goes through stdio, so get it out first.
+    fflush(list);
+    if (hex_write(out, hex, hex_len) < 0) {
+        warning_e("Can't write output");
+        rtn = E_COMMON;
+    }
+    free(hex);
+    return rtn;
+}
+
+
+static
+void assemble_one(void* const arg, const size_t i, const unsigned int worker)
+{
+    struct batch* const batch = arg;
+    struct cpic* const cp = batch->asms[worker];
+    const struct job job = { .batch = batch, .path = batch->paths[i] };
+
+    if (batch->count == 1) {
+        batch->rtn = assemble_file(cp, &job, STDOUT_FILENO, stdout);
+        return;
+    }
+
+    char* out_path = hex_path(job.path);
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+        fatal_e(E_COMMON, "Can't create file \"%s\"", out_path);
+
+    // Keep each file's listing together rather than interleaving them.
+    char* list_buf = NULL;
+    size_t list_len = 0;
+    FILE* list = open_memstream(&list_buf, &list_len);
+    if (list == NULL)
+        fatal_e(E_COMMON, "Can't allocate listing");
+
+    int rtn = assemble_file(cp, &job, out, list);
+
+    fclose(list);
+    if (close(out) < 0 && rtn == 0) {
+        warning_e("Can't write file \"%s\"", out_path);
+        rtn = E_COMMON;
+    }
+    if (rtn != 0)
+        unlink(out_path); // (Ignore errors.)
+
+    pthread_mutex_lock(&batch->out_lock);
+    if (list_len > 0) {
+        printf("%s:\n", job.path);
+        fwrite(list_buf, 1, list_len, stdout);
+    }
+    if (rtn > batch->rtn)
+        batch->rtn = rtn;
+    pthread_mutex_unlock(&batch->out_lock);
+
+    free(list_buf);
+    free(out_path);
+}
+
+
 int main(int argc, char** argv)
 {
     // Do some setup.
@@ -67,21 +282,59 @@ int main(int argc, char** argv)
 
     int source_idx = process_args(argc, argv);
 
-    // Get ready to read the source file.
+    if (serve_path != NULL) {
+        if (source_idx < argc)
+            fatal(E_ARG, "Files can't be given with --serve");
+        if (profile_path != NULL)
+            fatal(E_ARG, "A profile can't be given with --serve");
+        serve(serve_path, jobs, opt);
+        return 0;
+    }
 
     if (source_idx >= argc)
         fatal(E_COMMON, "No file specified");
 
-    int src = open(argv[source_idx], O_RDONLY);
-    if (src < 0)
-        fatal_e(E_COMMON, "Can't open file \"%s\"", argv[source_idx]);
+    if (profile_path != NULL) {
+        int fd = open(profile_path, O_RDONLY);
+        if (fd < 0)
+            fatal_e(E_COMMON, "Can't open file \"%s\"", profile_path);
+        if (bufmap(fd, &profile) < 0)
+            fatal_e(E_COMMON, "Can't read from profile \"%s\"",
+                profile_path);
+        close(fd); // (Ignore errors.)
+    }
+
+    struct batch batch = {
+        .paths = &argv[source_idx],
+        .count = argc - source_idx,
+    };
+    if (jobs > batch.count)
+        jobs = batch.count;
+    pthread_mutex_init(&batch.out_lock, NULL);
+
+    // Each worker keeps its own assembler context (and its memory) from one
+    // file to the next.
 
-    // Assemble the source file.
+    batch.asms = malloc(jobs * sizeof(struct cpic*));
+    if (batch.asms == NULL)
+        fatal_e(E_COMMON, "Can't allocate assemblers");
+    for (unsigned int i = 0; i < jobs; ++i) {
+        batch.asms[i] = cpic_new();
+        if (batch.asms[i] == NULL)
+            fatal_e(E_COMMON, "Can't allocate assemblers");
+    }
+
+    // Assemble the source files.
 
-    assemble_emr(src);
+    pool_run(jobs, batch.count, assemble_one, &batch);
 
     // Clean up and exit.
 
-    close(src); // (Ignore errors.)
-    return 0;
+    for (unsigned int i = 0; i < jobs; ++i)
+        cpic_free(batch.asms[i]);
+    free(batch.asms);
+    pthread_mutex_destroy(&batch.out_lock);
+    if (profile_path != NULL)
+        bufunmap(&profile);
+    return batch.rtn;
 }
@@ -6,50 +6,228 @@
 
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define arrind(d, i) ((char*)((d)->array) + (i) * (d)->value_len)
+
+// This is a Swiss table: each slot has a control byte that's either
+// CTRL_EMPTY or the low 7 bits of the key's hash, and lookups compare a
+// whole group of control bytes at once before touching any keys. The first
+// GROUP_LEN control bytes are mirrored after the end so a group can start
+// at any slot.
+
+#define GROUP_LEN 16
+#define MIN_CAPACITY 16
+#define CTRL_EMPTY 0x80
+
+#define arrind(d, i) ((d)->values + (i) * (d)->value_len)
+
+
+struct dict_slot {
+    const char* key;
+    size_t len;
+    uint64_t hash;
+};
+
+
+static inline
+uint64_t load64(const char* p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+
+// Multiply-xorshift hash, 8 bytes at a time.
+static
+uint64_t hash(const char* str, size_t len)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15u;
+    uint64_t h = len * k;
+    size_t i = 0;
+    for (/* */; i + 8 <= len; i += 8)
+        h = (h ^ load64(&str[i])) * k;
+    if (i < len) {
+        uint64_t tail = 0;
+        memcpy(&tail, &str[i], len - i);
+        h = (h ^ tail) * k;
+    }
+    h ^= h >> 32;
+    h *= k;
+    h ^= h >> 29;
+    return h;
+}
+
+
+static inline
+uint8_t h2(uint64_t h)
+{
+    return h & 0x7F;
+}
+
+
+// Bit i of the result is set if group byte i equals b.
+static inline
+unsigned int match_byte(const uint8_t* group, uint8_t b)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+#else
+    unsigned int mask = 0;
+    for (unsigned int i = 0; i < GROUP_LEN; ++i)
+        mask |= (unsigned int)(group[i] == b) << i;
+    return mask;
+#endif
+}
+
+
+static inline
+unsigned int lowest_bit(unsigned int mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    unsigned int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++i;
+    }
+    return i;
+#endif
+}
+
+
+static inline
+void set_ctrl(struct dict* dict, size_t i, uint8_t c)
+{
+    dict->ctrl[i] = c;
+    if (i < GROUP_LEN)
+        dict->ctrl[dict->capacity + i] = c;
+}
 
 
-// djb2 by Dan Bernstein
 static
-unsigned long hash(const char* str)
+void alloc_table(struct dict* dict, size_t capacity)
 {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *(str++)))
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
-    return hash;
+    dict->capacity = capacity;
+    dict->count = 0;
+    dict->ctrl = malloc(capacity + GROUP_LEN);
+    dict->slots = malloc(capacity * sizeof(struct dict_slot));
+    dict->values = malloc(capacity * dict->value_len);
+    if (dict->ctrl == NULL || dict->slots == NULL || dict->values == NULL)
+        fatal_e(E_COMMON, "Can't allocate dict");
+    memset(dict->ctrl, CTRL_EMPTY, capacity + GROUP_LEN);
 }
 
 
-void dict_init(const struct dict* const dict)
+// Find the first empty slot on h's probe sequence.
+static
+size_t find_empty(const struct dict* dict, uint64_t h)
 {
-    for (size_t i = 0; i < dict->capacity; ++i)
-        *(char**)arrind(dict, i) = NULL;
+    size_t mask = dict->capacity - 1;
+    size_t pos = h >> 7 & mask;
+    for (size_t stride = GROUP_LEN; /* */; stride += GROUP_LEN) {
+        unsigned int empty = match_byte(&dict->ctrl[pos], CTRL_EMPTY);
+        if (empty)
+            return (pos + lowest_bit(empty)) & mask;
+        pos = (pos + stride) & mask;
+    }
 }
 
 
-void* dict_avail(const struct dict* const dict, const char* const key)
+static
+void grow(struct dict* dict)
 {
-    size_t h = hash(key) % dict->capacity;
-    while (*(char**)arrind(dict, h) != NULL) {
-        ++h;
-        if (h >= dict->capacity)
-            fatal(1, "Dict is full");
+    struct dict old = *dict;
+    alloc_table(dict, old.capacity * 2);
+
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.ctrl[i] == CTRL_EMPTY)
+            continue;
+        size_t j = find_empty(dict, old.slots[i].hash);
+        set_ctrl(dict, j, h2(old.slots[i].hash));
+        dict->slots[j] = old.slots[i];
+        memcpy(arrind(dict, j), arrind(&old, i), dict->value_len);
     }
-    return (void*)arrind(dict, h);
+    dict->count = old.count;
+
+    dict_free(&old);
+}
+
+
+void dict_init(struct dict* const dict, const size_t value_len)
+{
+    dict->value_len = value_len;
+    alloc_table(dict, MIN_CAPACITY);
+}
+
+
+// Remove every entry but keep the memory.
+void dict_clear(struct dict* const dict)
+{
+    memset(dict->ctrl, CTRL_EMPTY, dict->capacity + GROUP_LEN);
+    dict->count = 0;
+}
+
+
+void dict_free(struct dict* const dict)
+{
+    free(dict->ctrl);
+    free(dict->slots);
+    free(dict->values);
+    dict->ctrl = NULL;
+    dict->slots = NULL;
+    dict->values = NULL;
+    dict->capacity = 0;
+    dict->count = 0;
+}
+
+
+// Add key and return a pointer to its (uninitialized) value. The key must
+// not already be present.
+void* dict_avail(struct dict* const dict, const char* const key,
+        const size_t len)
+{
+    // Keep the load factor at or below 7/8.
+    if ((dict->count + 1) * 8 > dict->capacity * 7)
+        grow(dict);
+
+    uint64_t h = hash(key, len);
+    size_t i = find_empty(dict, h);
+    set_ctrl(dict, i, h2(h));
+    dict->slots[i].key = key;
+    dict->slots[i].len = len;
+    dict->slots[i].hash = h;
+    ++dict->count;
+    return arrind(dict, i);
 }
 
 
-void* dict_get(const struct dict* const dict, const char* const key)
+void* dict_get(const struct dict* const dict, const char* const key,
+        const size_t len)
 {
-    size_t h = hash(key) % dict->capacity;
-    while (h < dict->capacity && *(char**)arrind(dict, h) != NULL) {
-        if (0 == strcmp(*(char**)arrind(dict, h), key))
-            return arrind(dict, h);
-        ++h;
+    uint64_t h = hash(key, len);
+    size_t mask = dict->capacity - 1;
+    size_t pos = h >> 7 & mask;
+    for (size_t stride = GROUP_LEN; /* */; stride += GROUP_LEN) {
+        const uint8_t* group = &dict->ctrl[pos];
+        unsigned int match = match_byte(group, h2(h));
+        while (match) {
+            size_t i = (pos + lowest_bit(match)) & mask;
+            const struct dict_slot* slot = &dict->slots[i];
+            if (slot->hash == h && slot->len == len
+                    && memcmp(slot->key, key, len) == 0)
+                return arrind(dict, i);
+            match &= match - 1;
+        }
+        if (match_byte(group, CTRL_EMPTY))
+            return NULL;
+        pos = (pos + stride) & mask;
     }
-    return NULL;
 }
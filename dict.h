@@ -2,15 +2,28 @@
 
 
 #include <stddef.h>
+#include <stdint.h>
 
 
+struct dict_slot;
+
+
+// Open-addressing hash table keyed by byte strings. Keys aren't copied, so
+// they have to outlive the dict (or the next dict_clear). Values are stored
+// inline and may move when the table grows, so don't hold on to a value
+// pointer across a dict_avail.
 struct dict {
-    void* array;
-    const size_t capacity;
-    const size_t value_len;
+    uint8_t* ctrl;
+    struct dict_slot* slots;
+    char* values;
+    size_t capacity;
+    size_t count;
+    size_t value_len;
 };
 
 
-void dict_init(const struct dict* dict);
-void* dict_avail(const struct dict* dict, const char* key);
-void* dict_get(const struct dict* dict, const char* key);
+void dict_init(struct dict* dict, size_t value_len);
+void dict_clear(struct dict* dict);
+void dict_free(struct dict* dict);
+void* dict_avail(struct dict* dict, const char* key, size_t len);
+void* dict_get(const struct dict* dict, const char* key, size_t len);
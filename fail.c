@@ -1,11 +1,59 @@
 #include "fail.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
 
+#define MSG_LEN 512
+
+
+static pthread_key_t trap_key;
+static pthread_once_t trap_once = PTHREAD_ONCE_INIT;
+
+
+static
+void trap_key_init(void)
+{
+    if (pthread_key_create(&trap_key, NULL) != 0)
+        abort();
+}
+
+
+static
+struct fail_trap* trap_get(void)
+{
+    pthread_once(&trap_once, trap_key_init);
+    return pthread_getspecific(trap_key);
+}
+
+
+// Set this thread's trap (NULL for none) and return the old one.
+struct fail_trap* fail_trap_set(struct fail_trap* const trap)
+{
+    struct fail_trap* old = trap_get();
+    pthread_setspecific(trap_key, trap);
+    return old;
+}
+
+
+// e is the saved errno, or negative if there's none to show.
+static
+void trap_report(struct fail_trap* const trap, const bool fatal, const int e,
+        const char* const format, va_list args)
+{
+    char msg[MSG_LEN];
+    int len = vsnprintf(msg, sizeof(msg), format, args);
+    if (len < 0)
+        len = 0;
+    if (e >= 0 && (size_t)len < sizeof(msg))
+        snprintf(&msg[len], sizeof(msg) - len, " (%s)", strerror(e));
+    trap->report(trap->arg, fatal, msg);
+}
+
+
 void vx_(const char* srcname, int line, const char* format, ...)
 {
     fflush(stdout);
@@ -24,6 +72,15 @@ void vx_(const char* srcname, int line, const char* format, ...)
 
 void warning_(const char* srcname, int line, const char* format, ...)
 {
+    struct fail_trap* trap = trap_get();
+    if (trap != NULL) {
+        va_list args;
+        va_start(args, format);
+        trap_report(trap, false, -1, format, args);
+        va_end(args);
+        return;
+    }
+
     fflush(stdout);
 #ifdef DEBUG
     fprintf(stderr, "%s:%d: ", srcname, line);
@@ -41,6 +98,15 @@ void warning_(const char* srcname, int line, const char* format, ...)
 void warning_e_(const char* srcname, int line, const char* format, ...)
 {
     int e = errno;
+    struct fail_trap* trap = trap_get();
+    if (trap != NULL) {
+        va_list args;
+        va_start(args, format);
+        trap_report(trap, false, e, format, args);
+        va_end(args);
+        return;
+    }
+
     fflush(stdout);
 #ifdef DEBUG
     fprintf(stderr, "%s:%d: ", srcname, line);
@@ -58,6 +124,16 @@ void warning_e_(const char* srcname, int line, const char* format, ...)
 void fatal_(int rtn, const char* srcname, int line,
         const char* format, ...)
 {
+    struct fail_trap* trap = trap_get();
+    if (trap != NULL) {
+        va_list args;
+        va_start(args, format);
+        trap_report(trap, true, -1, format, args);
+        va_end(args);
+        trap->rtn = rtn;
+        longjmp(trap->env, 1);
+    }
+
     fflush(stdout);
 #ifdef DEBUG
     fprintf(stderr, "%s:%d: ", srcname, line);
@@ -77,6 +153,16 @@ void fatal_e_(int rtn, const char* srcname, int line,
         const char* format, ...)
 {
     int e = errno;
+    struct fail_trap* trap = trap_get();
+    if (trap != NULL) {
+        va_list args;
+        va_start(args, format);
+        trap_report(trap, true, e, format, args);
+        va_end(args);
+        trap->rtn = rtn;
+        longjmp(trap->env, 1);
+    }
+
     fflush(stdout);
 #ifdef DEBUG
     fprintf(stderr, "%s:%d: ", srcname, line);
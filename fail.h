@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#include <setjmp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -26,6 +28,19 @@ extern int verbosity;
                           __VA_ARGS__); } while (0)
 
 
+// While a trap is set on a thread, warnings and errors on that thread go to
+// its report function instead of stderr, and fatal errors store their
+// return code in rtn and longjmp to env instead of exiting.
+struct fail_trap {
+    jmp_buf env;
+    int rtn;
+    void (*report)(void* arg, bool fatal, const char* msg);
+    void* arg;
+};
+
+
+struct fail_trap* fail_trap_set(struct fail_trap* const trap);
+
 void vx_(const char* srcname, int line, const char* format, ...);
 void warning_(const char* srcname, int line, const char* format, ...);
 void warning_e_(const char* srcname, int line, const char* format, ...);
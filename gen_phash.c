@@ -0,0 +1,170 @@
+// Generate minimal perfect hash tables for the mnemonic and core register
+// names in arch_emr_isa.c and write them to stdout as a C header.
+
+#include "common.h"
+#include "arch_emr_isa.h"
+
+#include "fail.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MAX_DISP 0xFFFF
+
+
+struct key {
+    const char* str;
+    size_t len;
+    uint32_t hash;
+    uint32_t bucket;
+};
+
+
+static uint32_t* sort_sizes;
+
+
+static
+int cmp_bucket(const void* a, const void* b)
+{
+    uint32_t ba = *(const uint32_t*)a;
+    uint32_t bb = *(const uint32_t*)b;
+    if (sort_sizes[ba] != sort_sizes[bb])
+        return sort_sizes[ba] > sort_sizes[bb] ? -1 : 1;
+    return ba < bb ? -1 : ba > bb;
+}
+
+
+// Try to place every key with the given seed. On success, fill in disp and
+// index and return true.
+static
+bool try_seed(struct key* keys, uint32_t n, uint32_t nb, uint32_t seed,
+        uint32_t* disp, int* index)
+{
+    uint32_t* sizes = calloc(nb, sizeof(uint32_t));
+    uint32_t* order = malloc(nb * sizeof(uint32_t));
+    bool* used = calloc(n, sizeof(bool));
+    uint32_t* slots = malloc(n * sizeof(uint32_t));
+    bool ok = true;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        keys[i].hash = isa_hash(keys[i].str, keys[i].len, seed);
+        keys[i].bucket = keys[i].hash % nb;
+        ++sizes[keys[i].bucket];
+    }
+    for (uint32_t b = 0; b < nb; ++b) {
+        order[b] = b;
+        disp[b] = 0;
+    }
+    sort_sizes = sizes;
+    qsort(order, nb, sizeof(uint32_t), cmp_bucket);
+    for (uint32_t i = 0; i < n; ++i)
+        index[i] = -1;
+
+    // Place the biggest buckets first, since they're the hardest to fit.
+    for (uint32_t o = 0; o < nb && ok; ++o) {
+        uint32_t b = order[o];
+        if (sizes[b] == 0)
+            break;
+
+        uint32_t d;
+        for (d = 0; d <= MAX_DISP; ++d) {
+            uint32_t count = 0;
+            bool fits = true;
+            for (uint32_t i = 0; i < n && fits; ++i) {
+                if (keys[i].bucket != b)
+                    continue;
+                uint32_t s = isa_slot(keys[i].hash, d, n);
+                if (used[s])
+                    fits = false;
+                for (uint32_t j = 0; j < count && fits; ++j)
+                    if (slots[j] == s)
+                        fits = false;
+                slots[count++] = s;
+            }
+            if (fits)
+                break;
+        }
+        if (d > MAX_DISP) {
+            ok = false;
+            break;
+        }
+
+        disp[b] = d;
+        for (uint32_t i = 0; i < n; ++i) {
+            if (keys[i].bucket != b)
+                continue;
+            uint32_t s = isa_slot(keys[i].hash, d, n);
+            used[s] = true;
+            index[s] = i;
+        }
+    }
+
+    free(sizes);
+    free(order);
+    free(used);
+    free(slots);
+    return ok;
+}
+
+
+static
+void gen_table(const char* macro, const char* name, struct key* keys,
+        uint32_t n)
+{
+    uint32_t nb = n / 2 + 1;
+    uint32_t* disp = malloc(nb * sizeof(uint32_t));
+    int* index = malloc(n * sizeof(int));
+
+    uint32_t seed;
+    for (seed = 0; seed < 1000000; ++seed)
+        if (try_seed(keys, n, nb, seed, disp, index))
+            break;
+    if (seed == 1000000)
+        fatal(E_RARE, "Can't find a perfect hash for %s", name);
+
+    printf("#define %s_PHASH_SEED 0x%08"PRIX32"u\n", macro, seed);
+    printf("#define %s_PHASH_LEN %"PRIu32"\n", macro, n);
+    printf("#define %s_PHASH_BUCKETS %"PRIu32"\n\n", macro, nb);
+
+    printf("static const uint16_t %s_phash_disp[] = {", name);
+    for (uint32_t b = 0; b < nb; ++b)
+        printf("%s%"PRIu32",", b % 12 == 0 ? "\n   " : " ", disp[b]);
+    printf("\n};\n\n");
+
+    printf("static const uint8_t %s_phash_index[] = {", name);
+    for (uint32_t i = 0; i < n; ++i)
+        printf("%s%d,", i % 12 == 0 ? "\n   " : " ", index[i]);
+    printf("\n};\n\n");
+
+    free(disp);
+    free(index);
+}
+
+
+int main(void)
+{
+    struct key* keys = malloc((insns_ref_len + cregs_ref_len)
+        * sizeof(struct key));
+
+    printf("// Generated by gen_phash from arch_emr_isa.c; don't edit.\n\n");
+    printf("#pragma once\n\n\n");
+
+    for (size_t i = 0; i < insns_ref_len; ++i) {
+        keys[i].str = insns_ref[i].str;
+        keys[i].len = strlen(insns_ref[i].str);
+    }
+    gen_table("INSN", "insn", keys, insns_ref_len);
+
+    for (size_t i = 0; i < cregs_ref_len; ++i) {
+        keys[i].str = cregs_ref[i].name;
+        keys[i].len = strlen(cregs_ref[i].name);
+    }
+    gen_table("CREG", "creg", keys, cregs_ref_len);
+
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "common.h"
+#include "hexout.h"
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+
+// Longest data record: colon, count, address, type, data, checksum, newline.
+#define DATA_RECORD_LEN (1 + 2 + 4 + 2 + HEX_RECORD_WORDS * 4 + 2 + 1)
+#define CFG_RECORD_LEN (1 + 2 + 4 + 2 + 4 + 2 + 1)
+
+static const char hex_ext_addr[] = ":020000040001F9\n";
+static const char hex_eof[] = ":00000001FF\n";
+
+static const char nibble_ascii[16] = "0123456789ABCDEF";
+
+
+static inline
+char* put_byte(char* p, uint8_t b, uint8_t* const sum)
+{
+    p[0] = nibble_ascii[b >> 4];
+    p[1] = nibble_ascii[b & 0xF];
+    *sum += b;
+    return p + 2;
+}
+
+
+// Start a record and return a pointer to its first data byte.
+static inline
+char* put_header(char* p, uint8_t count, uint16_t addr, uint8_t* const sum)
+{
+    *sum = 0;
+    *p++ = ':';
+    p = put_byte(p, count, sum);
+    p = put_byte(p, addr >> 8, sum);
+    p = put_byte(p, addr & 0xFF, sum);
+    return put_byte(p, 0x00, sum);
+}
+
+
+static inline
+char* put_trailer(char* p, uint8_t sum)
+{
+    uint8_t ignored;
+    p = put_byte(p, -sum, &ignored);
+    *p++ = '\n';
+    return p;
+}
+
+
+// Upper bound on the output of hex_format.
+size_t hex_bound(size_t image_len, size_t cfg_len)
+{
+    size_t records = (image_len + HEX_RECORD_WORDS - 1) / HEX_RECORD_WORDS;
+    return records * DATA_RECORD_LEN + (sizeof(hex_ext_addr) - 1)
+        + cfg_len * CFG_RECORD_LEN + (sizeof(hex_eof) - 1);
+}
+
+
+// Format a program image followed by the configuration words (negative
+// entries are skipped) as Intel HEX. buf must hold at least hex_bound()
+// bytes. Returns the number of bytes written; the result isn't terminated.
+size_t hex_format(char* const buf, const uint16_t* image, size_t image_len,
+    const int16_t* cfg, size_t cfg_len)
+{
+    char* p = buf;
+    uint8_t sum;
+
+    for (size_t addr = 0; addr < image_len; addr += HEX_RECORD_WORDS) {
+        size_t count = image_len - addr;
+        if (count > HEX_RECORD_WORDS)
+            count = HEX_RECORD_WORDS;
+        p = put_header(p, count * 2, addr * 2, &sum);
+        for (size_t i = 0; i < count; ++i) {
+            p = put_byte(p, image[addr + i] & 0xFF, &sum);
+            p = put_byte(p, image[addr + i] >> 8, &sum);
+        }
+        p = put_trailer(p, sum);
+    }
+
+    memcpy(p, hex_ext_addr, sizeof(hex_ext_addr) - 1);
+    p += sizeof(hex_ext_addr) - 1;
+    for (size_t a = 0; a < cfg_len; ++a) {
+        if (cfg[a] < 0)
+            continue;
+        p = put_header(p, 2, a * 2, &sum);
+        p = put_byte(p, cfg[a] & 0xFF, &sum);
+        p = put_byte(p, cfg[a] >> 8, &sum);
+        p = put_trailer(p, sum);
+    }
+
+    memcpy(p, hex_eof, sizeof(hex_eof) - 1);
+    p += sizeof(hex_eof) - 1;
+
+    return p - buf;
+}
+
+
+// Write all of buf, retrying on short writes. Returns -1 with errno set on
+// failure.
+int hex_write(const int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t count = write(fd, buf, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += count;
+        len -= count;
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Program words per data record.
+#define HEX_RECORD_WORDS 8
+
+
+size_t hex_bound(size_t image_len, size_t cfg_len);
+size_t hex_format(char* const buf, const uint16_t* image, size_t image_len,
+    const int16_t* cfg, size_t cfg_len);
+int hex_write(const int fd, const char* buf, size_t len);
@@ -0,0 +1,119 @@
+#include "common.h"
+#include "libcpic.h"
+
+#include "arch_emr.h"
+#include "fail.h"
+#include "hexout.h"
+
+
+#include <stdlib.h>
+
+
+struct cpic {
+    struct emr* emr;
+};
+
+
+static const struct cpic_options default_options;
+
+
+static
+void report(void* const arg, const bool fatal, const char* const msg)
+{
+    const struct cpic_options* const opts = arg;
+    if (opts->diag != NULL)
+        opts->diag(opts->diag_arg, fatal, msg);
+}
+
+
+// Returns NULL if out of memory. An assembler can be reused any number of
+// times, but only by one thread at a time.
+struct cpic* cpic_new(void)
+{
+    struct cpic* cp = malloc(sizeof(struct cpic));
+    if (cp == NULL)
+        return NULL;
+    cp->emr = emr_new();
+    if (cp->emr == NULL) {
+        free(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+
+void cpic_free(struct cpic* const cp)
+{
+    if (cp == NULL)
+        return;
+    emr_free(cp->emr);
+    free(cp);
+}
+
+
+// Keep parsed lines from one assembly to the next so that lines seen before
+// don't have to be lexed and parsed again. Up to about max_lines distinct
+// lines are kept before the cache starts over. Every pass still runs in
+// full, so the output is the same as without the cache. Returns 0, or
+// E_COMMON if out of memory.
+int cpic_cache_lines(struct cpic* const cp, const size_t max_lines)
+{
+    struct fail_trap trap = { .report = report,
+        .arg = (void*)&default_options };
+    struct fail_trap* const old = fail_trap_set(&trap);
+
+    int rtn = 0;
+    if (setjmp(trap.env) == 0)
+        emr_cache_lines(cp->emr, max_lines);
+    else
+        rtn = trap.rtn;
+
+    fail_trap_set(old);
+    return rtn;
+}
+
+
+// Assemble len bytes of source (which needn't be NUL-terminated). Returns 0
+// on success, or else the code cpic would exit with (E_COMMON for errors in
+// the source); in that case the error has been passed to opts->diag and
+// image is left empty. opts may be NULL.
+int cpic_assemble(struct cpic* const cp, const char* const src,
+    const size_t len, const struct cpic_options* opts,
+    struct cpic_image* const image)
+{
+    if (opts == NULL)
+        opts = &default_options;
+
+    struct fail_trap trap = { .report = report, .arg = (void*)opts };
+    struct fail_trap* const old = fail_trap_set(&trap);
+
+    int rtn = 0;
+    if (setjmp(trap.env) == 0) {
+        assemble_emr(cp->emr, src, len, opts, image);
+    } else {
+        // Whatever was allocated is in the arena, which the next assembly
+        // resets.
+        rtn = trap.rtn;
+        image->words = NULL;
+        image->len = 0;
+    }
+
+    fail_trap_set(old);
+    return rtn;
+}
+
+
+// Upper bound on the length of image as Intel HEX.
+size_t cpic_hex_bound(const struct cpic_image* const image)
+{
+    return hex_bound(image->len, CPIC_CFG_LEN);
+}
+
+
+// Format image as Intel HEX into buf, which must hold cpic_hex_bound()
+// bytes. Returns the length written (not NUL-terminated).
+size_t cpic_hex_format(const struct cpic_image* const image, char* const buf)
+{
+    return hex_format(buf, image->words, image->len, image->cfg,
+        CPIC_CFG_LEN);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+// Configuration words, starting at 0x8000.
+#define CPIC_CFG_LEN 0x10
+
+
+// Called once per warning or error. fatal is true for the error that ends
+// the assembly. msg is only valid during the call.
+typedef void cpic_diag_fn(void* arg, bool fatal, const char* msg);
+
+
+// Optional passes, for cpic_options.opt.
+#define CPIC_OPT_PEEPHOLE 0x01 // (W and STATUS peephole optimizer)
+#define CPIC_OPT_JUMPS 0x02 // (jump threading, unreachable code)
+#define CPIC_OPT_INLINE 0x04 // (inlining, tail calls)
+#define CPIC_OPT_VENEERS 0x08 // (shared far jumps)
+#define CPIC_OPT_PLACE 0x10 // (moving code between pages)
+#define CPIC_OPT_OUTLINE 0x20 // (tail merging, outlining)
+
+
+struct cpic_options {
+    int verbosity; // (0 for no listing)
+    unsigned int opt; // (CPIC_OPT_* flags)
+    const char* profile; // label counts for CPIC_OPT_PLACE (NULL for none)
+    size_t profile_len;
+    FILE* list; // where the listing goes (NULL for none)
+    cpic_diag_fn* diag; // (NULL to ignore diagnostics)
+    void* diag_arg;
+};
+
+
+// Output of one assembly. words is owned by the assembler and stays valid
+// until its next assembly or until it's freed.
+struct cpic_image {
+    const uint16_t* words;
+    size_t len;
+    int16_t cfg[CPIC_CFG_LEN]; // (negative if not set)
+};
+
+
+struct cpic;
+
+
+struct cpic* cpic_new(void);
+void cpic_free(struct cpic* const cp);
+int cpic_cache_lines(struct cpic* const cp, const size_t max_lines);
+int cpic_assemble(struct cpic* const cp, const char* const src,
+    const size_t len, const struct cpic_options* const opts,
+    struct cpic_image* const image);
+
+size_t cpic_hex_bound(const struct cpic_image* const image);
+size_t cpic_hex_format(const struct cpic_image* const image, char* const buf);
@@ -0,0 +1,135 @@
+#include "common.h"
+#include "pool.h"
+
+#include "fail.h"
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+
+// Jobs not yet started by one worker, [next, end). Other workers steal from
+// the top.
+struct pool_queue {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+};
+
+
+struct pool {
+    struct pool_queue* queues;
+    unsigned int workers;
+    pool_job_fn* fn;
+    void* arg;
+};
+
+
+struct pool_worker {
+    struct pool* pool;
+    unsigned int id;
+    pthread_t thread;
+};
+
+
+static
+bool pool_take(struct pool_queue* const q, size_t* const job)
+{
+    pthread_mutex_lock(&q->lock);
+    bool found = (q->next < q->end);
+    if (found)
+        *job = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+
+// Move the upper half of some other worker's queue into ours. Returns false
+// once every queue is empty.
+static
+bool pool_steal(struct pool* const pool, const unsigned int thief)
+{
+    for (unsigned int i = 1; i < pool->workers; ++i) {
+        struct pool_queue* victim = &pool->queues[(thief + i) % pool->workers];
+
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        size_t mid = victim->next + left / 2;
+        size_t end = victim->end;
+        victim->end = mid;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (mid < end) {
+            struct pool_queue* q = &pool->queues[thief];
+            pthread_mutex_lock(&q->lock);
+            q->next = mid;
+            q->end = end;
+            pthread_mutex_unlock(&q->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static
+void* pool_work(void* const arg)
+{
+    struct pool_worker* const w = arg;
+    struct pool* const pool = w->pool;
+
+    size_t job;
+    do {
+        while (pool_take(&pool->queues[w->id], &job))
+            pool->fn(pool->arg, job, w->id);
+    } while (pool_steal(pool, w->id));
+
+    return NULL;
+}
+
+
+// Run fn on every job number in [0, count) using up to `workers` threads
+// (the caller's included). Each worker starts with an even share of the
+// jobs and steals from the others once it runs dry, so a few slow jobs
+// don't leave the rest of the threads idle.
+void pool_run(unsigned int workers, const size_t count, pool_job_fn* const fn,
+    void* const arg)
+{
+    if (workers > count)
+        workers = count;
+    if (workers == 0)
+        return;
+
+    struct pool pool = {
+        .queues = malloc(workers * sizeof(struct pool_queue)),
+        .workers = workers,
+        .fn = fn,
+        .arg = arg,
+    };
+    struct pool_worker* w = malloc(workers * sizeof(struct pool_worker));
+    if (pool.queues == NULL || w == NULL)
+        fatal_e(E_COMMON, "Can't allocate thread pool");
+
+    for (unsigned int i = 0; i < workers; ++i) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].next = count * i / workers;
+        pool.queues[i].end = count * (i + 1) / workers;
+        w[i].pool = &pool;
+        w[i].id = i;
+    }
+
+    for (unsigned int i = 1; i < workers; ++i) {
+        int err = pthread_create(&w[i].thread, NULL, pool_work, &w[i]);
+        if (err != 0)
+            fatal(E_COMMON, "Can't start worker thread (error %d)", err);
+    }
+    pool_work(&w[0]);
+    for (unsigned int i = 1; i < workers; ++i)
+        pthread_join(w[i].thread, NULL);
+
+    for (unsigned int i = 0; i < workers; ++i)
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    free(w);
+    free(pool.queues);
+}
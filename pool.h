@@ -0,0 +1,11 @@
+#pragma once
+
+
+#include <stddef.h>
+
+
+typedef void pool_job_fn(void* arg, size_t job, unsigned int worker);
+
+
+void pool_run(unsigned int workers, size_t count, pool_job_fn* fn,
+    void* arg);
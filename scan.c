@@ -0,0 +1,220 @@
+#include "common.h"
+#include "scan.h"
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#define SCAN_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_AVX2 1
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
+
+// The lexer spends nearly all its time looking for the next separator or,
+// inside a comment, the next newline. These find them 16 or 32 bytes at a
+// time. Each returns the offset of the first match in p[0..n), or n if
+// there isn't one.
+//
+// The separators are ":,; \t\n" plus NUL, which the lexer has always
+// treated as one.
+
+
+static inline
+bool is_sep(char c)
+{
+    return c == ':' || c == ',' || c == ';' || c == ' ' || c == '\t'
+        || c == '\n' || c == '\0';
+}
+
+
+static inline
+unsigned int lowest_bit(uint32_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    unsigned int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++i;
+    }
+    return i;
+#endif
+}
+
+
+static
+size_t scan_sep_scalar(const char* p, size_t n, size_t i)
+{
+    for (/* */; i < n; ++i)
+        if (is_sep(p[i]))
+            return i;
+    return n;
+}
+
+
+static
+size_t scan_nl_scalar(const char* p, size_t n, size_t i)
+{
+    for (/* */; i < n; ++i)
+        if (p[i] == '\n')
+            return i;
+    return n;
+}
+
+
+#ifdef SCAN_SSE2
+
+static inline
+uint32_t sep_mask16(__m128i v)
+{
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')))),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+            _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+    return _mm_movemask_epi8(m);
+}
+
+
+static
+size_t scan_sep_sse2(const char* p, size_t n)
+{
+    size_t i = 0;
+    for (/* */; i + 16 <= n; i += 16) {
+        uint32_t mask = sep_mask16(_mm_loadu_si128((const __m128i*)&p[i]));
+        if (mask)
+            return i + lowest_bit(mask);
+    }
+    return scan_sep_scalar(p, n, i);
+}
+
+
+static
+size_t scan_nl_sse2(const char* p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (/* */; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&p[i]);
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+            return i + lowest_bit(mask);
+    }
+    return scan_nl_scalar(p, n, i);
+}
+
+#endif
+
+
+#ifdef SCAN_AVX2
+
+__attribute__((target("avx2")))
+static
+size_t scan_sep_avx2(const char* p, size_t n)
+{
+    size_t i = 0;
+    for (/* */; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&p[i]);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')))),
+            _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+        uint32_t mask = _mm256_movemask_epi8(m);
+        if (mask)
+            return i + lowest_bit(mask);
+    }
+    return i + scan_sep_sse2(&p[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static
+size_t scan_nl_avx2(const char* p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (/* */; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&p[i]);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask)
+            return i + lowest_bit(mask);
+    }
+    return i + scan_nl_sse2(&p[i], n - i);
+}
+
+#endif
+
+
+#ifndef SCAN_SSE2
+
+static
+size_t scan_sep_generic(const char* p, size_t n)
+{
+    return scan_sep_scalar(p, n, 0);
+}
+
+
+static
+size_t scan_nl_generic(const char* p, size_t n)
+{
+    return scan_nl_scalar(p, n, 0);
+}
+
+static size_t (*scan_sep_impl)(const char*, size_t) = scan_sep_generic;
+static size_t (*scan_nl_impl)(const char*, size_t) = scan_nl_generic;
+
+#else
+
+static size_t (*scan_sep_impl)(const char*, size_t) = scan_sep_sse2;
+static size_t (*scan_nl_impl)(const char*, size_t) = scan_nl_sse2;
+
+#endif
+
+
+#if defined(SCAN_AVX2)
+
+// Switch to AVX2 if this CPU has it. This runs before main, so it's done
+// before any assembler threads can be reading the pointers.
+__attribute__((constructor))
+static
+void scan_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_sep_impl = scan_sep_avx2;
+        scan_nl_impl = scan_nl_avx2;
+    }
+}
+
+#endif
+
+
+size_t scan_sep(const char* p, size_t n)
+{
+    return scan_sep_impl(p, n);
+}
+
+
+size_t scan_nl(const char* p, size_t n)
+{
+    return scan_nl_impl(p, n);
+}
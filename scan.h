@@ -0,0 +1,8 @@
+#pragma once
+
+
+#include <stddef.h>
+
+
+size_t scan_sep(const char* p, size_t n);
+size_t scan_nl(const char* p, size_t n);
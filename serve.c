@@ -0,0 +1,219 @@
+#include "common.h"
+#include "serve.h"
+
+#include "fail.h"
+#include "libcpic.h"
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// Protocol: a client connects, sends the source and shuts down its side of
+// the connection. The server answers with one status line,
+//
+//     STATUS DIAG_LEN HEX_LEN\n
+//
+// followed by DIAG_LEN bytes of diagnostics (one per line) and HEX_LEN
+// bytes of Intel HEX, then closes the connection. STATUS is 0 on success,
+// or else the code cpic would have exited with, in which case HEX_LEN is 0.
+
+
+#define READ_CHUNK_LEN 65536
+#define MAX_SOURCE_LEN (64 << 20)
+#define MAX_CACHED_LINES (1 << 20)
+
+
+// Everything a worker keeps from one request to the next.
+struct worker {
+    int listen_fd;
+    pthread_t thread;
+    unsigned int opt; // (CPIC_OPT_* passes to run)
+    struct cpic* cp;
+    char* src;
+    size_t src_cap;
+    char* hex;
+    size_t hex_cap;
+};
+
+
+static
+void collect_diag(void* const arg, const bool fatal, const char* const msg)
+{
+    (void)fatal;
+    fprintf(arg, "%s\n", msg);
+}
+
+
+// Read until EOF. Returns the length, or -1 if the connection failed or the
+// source is too long.
+static
+ssize_t recv_source(struct worker* const w, const int conn)
+{
+    size_t len = 0;
+    while (true) {
+        if (w->src_cap - len < READ_CHUNK_LEN) {
+            if (w->src_cap >= MAX_SOURCE_LEN)
+                return -1;
+            size_t cap = (w->src_cap == 0) ? READ_CHUNK_LEN * 2
+                : w->src_cap * 2;
+            char* src = realloc(w->src, cap);
+            if (src == NULL)
+                return -1;
+            w->src = src;
+            w->src_cap = cap;
+        }
+        ssize_t count = recv(conn, &w->src[len], w->src_cap - len, 0);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (count == 0)
+            return len;
+        len += count;
+    }
+}
+
+
+// Returns false if the client has gone away.
+static
+bool send_all(const int conn, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t count = send(conn, buf, len, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += count;
+        len -= count;
+    }
+    return true;
+}
+
+
+static
+void serve_one(struct worker* const w, const int conn)
+{
+    char* diag = NULL;
+    size_t diag_len = 0;
+    FILE* diag_stream = open_memstream(&diag, &diag_len);
+    if (diag_stream == NULL)
+        return;
+
+    int rtn;
+    size_t hex_len = 0;
+    ssize_t src_len = recv_source(w, conn);
+    if (src_len < 0) {
+        fprintf(diag_stream, "Can't read source (or it's over %d bytes)\n",
+            MAX_SOURCE_LEN);
+        rtn = E_COMMON;
+    } else {
+        const struct cpic_options opts = {
+            .opt = w->opt,
+            .diag = collect_diag,
+            .diag_arg = diag_stream,
+        };
+        struct cpic_image image;
+        rtn = cpic_assemble(w->cp, w->src, src_len, &opts, &image);
+        if (rtn == 0) {
+            size_t bound = cpic_hex_bound(&image);
+            if (bound > w->hex_cap) {
+                free(w->hex);
+                w->hex = malloc(bound);
+                w->hex_cap = (w->hex == NULL) ? 0 : bound;
+            }
+            if (w->hex == NULL) {
+                fprintf(diag_stream, "Can't allocate output buffer\n");
+                rtn = E_COMMON;
+            } else {
+                hex_len = cpic_hex_format(&image, w->hex);
+            }
+        }
+    }
+    fclose(diag_stream);
+
+    char status[64];
+    int status_len = snprintf(status, sizeof(status), "%d %zu %zu\n", rtn,
+        diag_len, hex_len);
+    if (send_all(conn, status, status_len)
+            && send_all(conn, diag, diag_len))
+        send_all(conn, w->hex, hex_len);
+
+    free(diag);
+}
+
+
+static
+void* serve_work(void* const arg)
+{
+    struct worker* const w = arg;
+
+    while (true) {
+        int conn = accept(w->listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fatal_e(E_COMMON, "Can't accept connection");
+        }
+        serve_one(w, conn);
+        close(conn); // (Ignore errors.)
+    }
+
+    return NULL;
+}
+
+
+// Listen on the Unix socket at path and answer requests, up to `workers` at
+// a time, until killed, running the optional passes in opt. Each worker
+// keeps its assembler, line cache and buffers warm between requests.
+void serve(const char* const path, const unsigned int workers,
+    const unsigned int opt)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        fatal(E_ARG, "Socket path too long");
+    strcpy(addr.sun_path, path);
+
+    // Replace a socket left behind by an earlier server, but nothing else.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path); // (Ignore errors.)
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        fatal_e(E_COMMON, "Can't create socket");
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        fatal_e(E_COMMON, "Can't bind to \"%s\"", path);
+    if (listen(fd, SOMAXCONN) < 0)
+        fatal_e(E_COMMON, "Can't listen on \"%s\"", path);
+
+    struct worker* w = calloc(workers, sizeof(struct worker));
+    if (w == NULL)
+        fatal_e(E_COMMON, "Can't allocate workers");
+    for (unsigned int i = 0; i < workers; ++i) {
+        w[i].listen_fd = fd;
+        w[i].opt = opt;
+        w[i].cp = cpic_new();
+        if (w[i].cp == NULL || cpic_cache_lines(w[i].cp, MAX_CACHED_LINES))
+            fatal_e(E_COMMON, "Can't allocate assemblers");
+    }
+
+    for (unsigned int i = 1; i < workers; ++i) {
+        int err = pthread_create(&w[i].thread, NULL, serve_work, &w[i]);
+        if (err != 0)
+            fatal(E_COMMON, "Can't start worker thread (error %d)", err);
+    }
+    serve_work(&w[0]);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+
+void serve(const char* const path, const unsigned int workers,
+    const unsigned int opt);
@@ -0,0 +1,97 @@
+#include "common.h"
+#include "symtab.h"
+
+#include "arena.h"
+#include "dict.h"
+#include "fail.h"
+
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Names are copied into the given arena, so they go away when it's reset.
+// The table itself is kept for reuse.
+void sym_init(struct symtab* const st, struct arena* const arena)
+{
+    st->names = arena;
+    if (st->refs.ctrl == NULL)
+        dict_init(&st->refs, sizeof(int));
+    else
+        dict_clear(&st->refs);
+    if (st->syms == NULL) {
+        st->cap = 256;
+        st->syms = malloc(st->cap * sizeof(struct sym));
+        if (st->syms == NULL)
+            fatal_e(E_COMMON, "Can't allocate symbol table");
+    }
+
+    // ID 0 is SYM_NONE.
+    st->syms[0].name = "";
+    st->syms[0].len = 0;
+    st->count = 1;
+}
+
+
+void sym_free(struct symtab* const st)
+{
+    dict_free(&st->refs);
+    free(st->syms);
+    st->syms = NULL;
+    st->cap = 0;
+    st->count = 0;
+}
+
+
+int sym_intern(struct symtab* const st, const char* const name,
+    const size_t len)
+{
+    int* ref = dict_get(&st->refs, name, len);
+    if (ref != NULL)
+        return *ref;
+
+    if (st->count == st->cap) {
+        st->cap *= 2;
+        st->syms = realloc(st->syms, st->cap * sizeof(struct sym));
+        if (st->syms == NULL)
+            fatal_e(E_COMMON, "Can't grow symbol table");
+    }
+
+    char* copy = arena_alloc(st->names, len + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    int id = st->count++;
+    st->syms[id].name = copy;
+    st->syms[id].len = len;
+
+    *(int*)dict_avail(&st->refs, copy, len) = id;
+    return id;
+}
+
+
+// The ID of a name, or SYM_NONE if it hasn't been interned.
+int sym_lookup(const struct symtab* const st, const char* const name,
+    const size_t len)
+{
+    const int* ref = dict_get(&st->refs, name, len);
+    return (ref != NULL) ? *ref : SYM_NONE;
+}
+
+
+const char* sym_name(const struct symtab* const st, const int id)
+{
+    return st->syms[id].name;
+}
+
+
+size_t sym_len(const struct symtab* const st, const int id)
+{
+    return st->syms[id].len;
+}
+
+
+size_t sym_count(const struct symtab* const st)
+{
+    return st->count;
+}
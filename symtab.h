@@ -0,0 +1,36 @@
+#pragma once
+
+
+#include "arena.h"
+#include "dict.h"
+
+#include <stddef.h>
+
+
+#define SYM_NONE 0
+
+
+struct sym {
+    const char* name;
+    size_t len;
+};
+
+
+// Zero-initialize before the first sym_init.
+struct symtab {
+    struct dict refs; // name -> ID
+    struct arena* names;
+    struct sym* syms;
+    size_t cap;
+    size_t count;
+};
+
+
+void sym_init(struct symtab* const st, struct arena* const arena);
+void sym_free(struct symtab* const st);
+int sym_intern(struct symtab* const st, const char* name, size_t len);
+int sym_lookup(const struct symtab* const st, const char* name,
+    size_t len);
+const char* sym_name(const struct symtab* const st, int id);
+size_t sym_len(const struct symtab* const st, int id);
+size_t sym_count(const struct symtab* const st);
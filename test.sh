@@ -3,9 +3,14 @@
 
 fail() { echo $1; exit 1; }
 
-for name in $(basename -a tests/cpic/*); do
+# tests/cpic/NAME.flags, if there is one, holds options for cpic.
+for name in $(basename -a tests/cpic/* | grep -v '\.flags$'); do
 	echo $name
-	./cpic tests/cpic/$name >/tmp/cpic.test.hex \
+	flags=
+	if [ -f tests/cpic/$name.flags ]; then
+		flags=$(cat tests/cpic/$name.flags)
+	fi
+	./cpic $flags tests/cpic/$name >/tmp/cpic.test.hex \
 		|| fail "cpic failed"
 	gpasm -w 1 -p 16F1704 -a INHX8M -o /tmp/gpasm.test.hex tests/gpasm/$name \
 		|| fail "gpasm failed"